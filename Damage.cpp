@@ -0,0 +1,107 @@
+/*
+ * Damage.cpp
+ *
+ * Copyright (C) 2021 RSP Systems <software@rspsystems.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include "Damage.h"
+
+static bool touches(const Damage::Rect &a, const Damage::Rect &b)
+{
+    return (a.x <= b.x + b.w) && (b.x <= a.x + a.w)
+        && (a.y <= b.y + b.h) && (b.y <= a.y + a.h);
+}
+
+void Damage::Clear()
+{
+    mFull = false;
+    mRects.clear();
+}
+
+void Damage::SetFull()
+{
+    mFull = true;
+    mRects.clear();
+}
+
+void Damage::Add(const Rect &aRect)
+{
+    if (mFull || (aRect.w == 0) || (aRect.h == 0)) {
+        return;
+    }
+
+    Rect r = aRect;
+
+    // Merge with every rectangle the new one touches, the union may
+    // touch rectangles the original did not, so repeat until stable.
+    bool merged = true;
+    while (merged) {
+        merged = false;
+        for (auto it = mRects.begin() ; it != mRects.end() ; ++it) {
+            if (touches(*it, r)) {
+                uint32_t x2 = std::max(it->x + it->w, r.x + r.w);
+                uint32_t y2 = std::max(it->y + it->h, r.y + r.h);
+                r.x = std::min(it->x, r.x);
+                r.y = std::min(it->y, r.y);
+                r.w = x2 - r.x;
+                r.h = y2 - r.y;
+                mRects.erase(it);
+                merged = true;
+                break;
+            }
+        }
+    }
+
+    if (mRects.size() >= cMAX_RECTS) {
+        SetFull();
+        return;
+    }
+    mRects.push_back(r);
+}
+
+void Damage::Add(const Damage &aOther)
+{
+    if (aOther.mFull) {
+        SetFull();
+        return;
+    }
+    for (const Rect &r : aOther.mRects) {
+        Add(r);
+    }
+}
+
+std::vector<Damage::Rect> Damage::GetRects(uint32_t aWidth, uint32_t aHeight) const
+{
+    if (mFull) {
+        return { { 0, 0, aWidth, aHeight } };
+    }
+    return mRects;
+}
+
+std::vector<Damage::Rect> Damage::SplitRows(const std::vector<Rect> &arRects, uint32_t aRow)
+{
+    std::vector<Rect> result;
+    for (const Rect &r : arRects) {
+        if ((r.y < aRow) && (r.y + r.h > aRow)) {
+            result.push_back({ r.x, r.y, r.w, aRow - r.y });
+            result.push_back({ r.x, aRow, r.w, r.y + r.h - aRow });
+        } else {
+            result.push_back(r);
+        }
+    }
+    return result;
+}
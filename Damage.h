@@ -0,0 +1,100 @@
+/*
+ * Damage.h
+ *
+ * Copyright (C) 2021 RSP Systems <software@rspsystems.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef DAMAGE_H_
+#define DAMAGE_H_
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * \class Damage
+ * \brief List of rectangles that changed since the previous frame.
+ *        Rectangles are in visible page coordinates, and overlapping
+ *        rectangles are merged when added.
+ */
+class Damage
+{
+public:
+    struct Rect {
+        uint32_t x;
+        uint32_t y;
+        uint32_t w;
+        uint32_t h;
+    };
+
+    /**
+     * \fn void Clear()
+     * \brief Nothing is damaged.
+     */
+    void Clear();
+
+    /**
+     * \fn void SetFull()
+     * \brief Everything is damaged.
+     */
+    void SetFull();
+
+    /**
+     * \fn void Add(const Rect&)
+     * \brief Add a rectangle, merging it with any rectangle it touches.
+     *
+     * \param aRect
+     */
+    void Add(const Rect &aRect);
+
+    /**
+     * \fn void Add(const Damage&)
+     * \brief Add all rectangles from another damage list.
+     *
+     * \param aOther
+     */
+    void Add(const Damage &aOther);
+
+    /**
+     * \fn std::vector<Rect> GetRects(uint32_t, uint32_t)
+     * \brief The rectangles to redraw on a page of the given size.
+     *
+     * \return The damaged rectangles, or the whole page if everything is damaged
+     */
+    std::vector<Rect> GetRects(uint32_t aWidth, uint32_t aHeight) const;
+
+    /**
+     * \fn std::vector<Rect> SplitRows(const std::vector<Rect>&, uint32_t)
+     * \brief Cut the rectangles that cross a row in two, e.g. where a page
+     *        wraps around the end of video memory.
+     *
+     * \param arRects
+     * \param aRow First row of the lower part
+     * \return Rectangles that each lie entirely above or below aRow
+     */
+    static std::vector<Rect> SplitRows(const std::vector<Rect> &arRects, uint32_t aRow);
+
+    bool IsFull() const { return mFull; }
+    bool IsEmpty() const { return !mFull && mRects.empty(); }
+    const std::vector<Rect>& GetRects() const { return mRects; }
+
+protected:
+    /** More rectangles than this are not worth tracking individually */
+    static const size_t cMAX_RECTS = 64;
+
+    bool mFull = true;
+    std::vector<Rect> mRects;
+};
+
+#endif /* DAMAGE_H_ */
@@ -58,6 +58,10 @@ void Epoll::Del(int aFd)
 int Epoll::Wait(struct epoll_event *aEvents, int aMaxEvents, int aTimeoutMilliSeconds)
 {
     int event_count = epoll_wait(mFd, aEvents, aMaxEvents, aTimeoutMilliSeconds);
+    if ((event_count == -1) && (errno == EINTR)) {
+        // A signal, e.g. SIGINT, is not an error. Let the caller check for events.
+        return 0;
+    }
     if (event_count == -1) {
         throw std::system_error(errno, std::generic_category(), "Failed waiting for epoll file descriptor");
     }
@@ -21,6 +21,7 @@
 #define EPOLL_H_
 
 #include <sys/epoll.h>
+#include "EventFd.h"
 
 /**
  * \class Epoll
@@ -35,6 +36,17 @@ public:
 
     void Add(int aFd, enum EPOLL_EVENTS aEpollEvents);
     void Del(int aFd);
+
+    /**
+     * \fn void Add(const EventFd&)
+     * \brief Wait for the event file descriptor to be signaled. The returned
+     *        event has data.fd set to arEventFd.GetFd().
+     *
+     * \param arEventFd
+     */
+    void Add(const EventFd &arEventFd) { Add(arEventFd.GetFd(), EPOLLIN); }
+    void Del(const EventFd &arEventFd) { Del(arEventFd.GetFd()); }
+
     int Wait(struct epoll_event *aEvents, int aMaxEvents, int aTimeoutMilliSeconds);
 
 protected:
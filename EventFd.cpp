@@ -0,0 +1,53 @@
+/*
+ * EventFd.cpp
+ *
+ * Copyright (C) 2021 RSP Systems <software@rspsystems.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "EventFd.h"
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <system_error>
+
+EventFd::EventFd()
+{
+    mFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mFd == -1) {
+        throw std::system_error(errno, std::generic_category(), "Failed to create eventfd");
+    }
+}
+
+EventFd::~EventFd()
+{
+    close(mFd);
+}
+
+void EventFd::Signal()
+{
+    uint64_t value = 1;
+    if (write(mFd, &value, sizeof(value)) == -1) {
+        throw std::system_error(errno, std::generic_category(), "Failed to signal eventfd");
+    }
+}
+
+uint64_t EventFd::Clear()
+{
+    uint64_t value = 0;
+    if ((read(mFd, &value, sizeof(value)) == -1) && (errno != EAGAIN)) {
+        throw std::system_error(errno, std::generic_category(), "Failed to read eventfd");
+    }
+    return value;
+}
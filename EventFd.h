@@ -0,0 +1,57 @@
+/*
+ * EventFd.h
+ *
+ * Copyright (C) 2021 RSP Systems <software@rspsystems.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVENTFD_H_
+#define EVENTFD_H_
+
+#include <cstdint>
+
+/**
+ * \class EventFd
+ * \brief C++ class wrapping a non-blocking eventfd, used to wake a thread
+ *        waiting in Epoll.
+ *
+ */
+class EventFd
+{
+public:
+    EventFd();
+    virtual ~EventFd();
+
+    /**
+     * \fn void Signal()
+     * \brief Make the file descriptor readable.
+     */
+    void Signal();
+
+    /**
+     * \fn uint64_t Clear()
+     * \brief Reset the file descriptor to not readable.
+     *
+     * \return Number of signals since the previous call
+     */
+    uint64_t Clear();
+
+    int GetFd() const { return mFd; }
+
+protected:
+    int mFd;
+};
+
+#endif /* EVENTFD_H_ */
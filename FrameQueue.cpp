@@ -0,0 +1,59 @@
+/*
+ * FrameQueue.cpp
+ *
+ * Copyright (C) 2021 RSP Systems <software@rspsystems.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "FrameQueue.h"
+
+FrameQueue::FrameQueue()
+{
+}
+
+void FrameQueue::Publish()
+{
+    // Release the frame content to the consumer
+    unsigned old = mShared.exchange(mBack | cFRESH, std::memory_order_acq_rel);
+    mBack = old & cINDEX_MASK;
+}
+
+bool FrameQueue::Reclaim()
+{
+    unsigned shared = mShared.load(std::memory_order_acquire);
+    if (!(shared & cFRESH)) {
+        return false;
+    }
+
+    // Fails if the consumer takes the frame in the meantime
+    if (!mShared.compare_exchange_strong(shared, mBack, std::memory_order_acq_rel)) {
+        return false;
+    }
+    mBack = shared & cINDEX_MASK;
+    return true;
+}
+
+Frame* FrameQueue::Acquire()
+{
+    unsigned shared = mShared.load(std::memory_order_acquire);
+    while (shared & cFRESH) {
+        // Fails if the producer publishes or reclaims in the meantime, which reloads shared
+        if (mShared.compare_exchange_weak(shared, mFront, std::memory_order_acq_rel)) {
+            mFront = shared & cINDEX_MASK;
+            return &mFrames[mFront];
+        }
+    }
+    return nullptr;
+}
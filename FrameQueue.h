@@ -0,0 +1,131 @@
+/*
+ * FrameQueue.h
+ *
+ * Copyright (C) 2021 RSP Systems <software@rspsystems.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef FRAMEQUEUE_H_
+#define FRAMEQUEUE_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#include <linux/fb.h>
+#include "Damage.h"
+
+/**
+ * \struct Frame
+ * \brief A converted page, handed from the conversion thread to the render thread.
+ */
+struct Frame
+{
+    /** Screen info the frame was converted from, with xres and yres swapped if rotated */
+    struct fb_var_screeninfo var = {};
+    /** Index of the page in the page cache of the view */
+    size_t pageIndex = 0;
+    /** Areas to upload, in page coordinates after rotation */
+    Damage damage;
+    /** First pixel of the page in output format, either in staging or in the frame buffer */
+    const uint8_t *pPixels = nullptr;
+    /** Bytes between rows of pPixels */
+    uint32_t pitch = 0;
+    /**
+     * Rows from wrapRow on continue at pWrapped, when the page wraps around
+     * the end of video memory (FB_VMODE_YWRAP). wrapRow is at least the
+     * height of the frame when it does not.
+     */
+    const uint8_t *pWrapped = nullptr;
+    uint32_t wrapRow = UINT32_MAX;
+    /** Converted pixels, for layouts that need conversion */
+    std::vector<uint32_t> staging;
+    uint64_t sequence = 0;
+    /** Sequence number of the last pan included, 0 if unknown */
+    uint32_t panSeq = 0;
+    /** When the notification was read from the view device */
+    std::chrono::steady_clock::time_point readTime;
+    /** When the frame was handed to the render thread */
+    std::chrono::steady_clock::time_point publishTime;
+
+    /**
+     * \fn const uint8_t* GetRow(uint32_t)
+     * \brief Address of the first pixel of a row, rows of a wrapped page included.
+     */
+    const uint8_t* GetRow(uint32_t aY) const
+    {
+        return (aY < wrapRow) ? pPixels + (size_t(aY) * pitch) : pWrapped + (size_t(aY - wrapRow) * pitch);
+    }
+};
+
+/**
+ * \class FrameQueue
+ * \brief Lock-free single producer, single consumer queue of frames, where
+ *        the latest frame wins.
+ *
+ *        Three frames rotate between the producer, the consumer and a shared
+ *        slot. The producer fills its frame and swaps it into the shared slot,
+ *        the consumer swaps the shared slot with the frame it has rendered.
+ *        Neither side ever waits for the other. A frame that was published
+ *        but not yet taken by the consumer can be reclaimed by the producer,
+ *        which then owns it again, and must carry its damage forward.
+ */
+class FrameQueue
+{
+public:
+    FrameQueue();
+
+    /**
+     * \fn Frame& GetBack()
+     * \brief The frame owned by the producer.
+     */
+    Frame& GetBack() { return mFrames[mBack]; }
+
+    /**
+     * \fn void Publish()
+     * \brief Hand the producer frame to the consumer, replacing any frame the
+     *        consumer has not taken yet.
+     */
+    void Publish();
+
+    /**
+     * \fn bool Reclaim()
+     * \brief Take back the published frame, if the consumer has not taken it yet.
+     *        On success GetBack() returns the reclaimed frame, with its content intact.
+     *
+     * \return true if the frame was reclaimed, i.e. it will never be rendered
+     */
+    bool Reclaim();
+
+    /**
+     * \fn Frame* Acquire()
+     * \brief Take the most recently published frame. The frame is owned by the
+     *        consumer until the next call.
+     *
+     * \return The frame, or nullptr if nothing was published since the previous call
+     */
+    Frame* Acquire();
+
+protected:
+    static const unsigned cINDEX_MASK = 0x3;
+    /** Set in the shared slot while it holds a frame not yet taken by the consumer */
+    static const unsigned cFRESH = 0x4;
+
+    Frame mFrames[3];
+    unsigned mBack = 0;
+    unsigned mFront = 1;
+    std::atomic<unsigned> mShared { 2 };
+};
+
+#endif /* FRAMEQUEUE_H_ */
@@ -0,0 +1,112 @@
+/*
+ * FrameScheduler.cpp
+ *
+ * Copyright (C) 2021 RSP Systems <software@rspsystems.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <system_error>
+#include "FrameScheduler.h"
+
+FrameScheduler::FrameScheduler()
+{
+    // steady_clock is CLOCK_MONOTONIC
+    mFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (mFd == -1) {
+        throw std::system_error(errno, std::generic_category(), "Failed to create timerfd");
+    }
+}
+
+FrameScheduler::~FrameScheduler()
+{
+    close(mFd);
+}
+
+void FrameScheduler::SetInterval(Clock::duration aInterval)
+{
+    mInterval = aInterval;
+}
+
+bool FrameScheduler::Notify()
+{
+    mNotifications++;
+    mPending = true;
+
+    Clock::time_point next = mLastFrame + mInterval;
+    if (Clock::now() >= next) {
+        return true;
+    }
+    if (!mArmed) {
+        Arm(next);
+    }
+    return false;
+}
+
+bool FrameScheduler::Expired()
+{
+    uint64_t expirations;
+    if ((read(mFd, &expirations, sizeof(expirations)) == -1) && (errno != EAGAIN)) {
+        throw std::system_error(errno, std::generic_category(), "Failed to read timerfd");
+    }
+    mArmed = false;
+    return mPending;
+}
+
+void FrameScheduler::FrameDone()
+{
+    mLastFrame = Clock::now();
+    if (mPending) {
+        mPacedFrames++;
+        mPending = false;
+    }
+}
+
+void FrameScheduler::Arm(Clock::time_point aExpiry)
+{
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(aExpiry.time_since_epoch()).count();
+
+    struct itimerspec spec = {};
+    spec.it_value.tv_sec = ns / 1000000000;
+    spec.it_value.tv_nsec = ns % 1000000000;
+    if (timerfd_settime(mFd, TFD_TIMER_ABSTIME, &spec, nullptr) == -1) {
+        throw std::system_error(errno, std::generic_category(), "Failed to arm timerfd");
+    }
+    mArmed = true;
+}
+
+FrameScheduler::Clock::duration FrameScheduler::GetRefreshInterval(const struct fb_var_screeninfo &aVar)
+{
+    uint64_t htotal = uint64_t(aVar.left_margin) + aVar.xres + aVar.right_margin + aVar.hsync_len;
+    uint64_t vtotal = uint64_t(aVar.upper_margin) + aVar.yres + aVar.lower_margin + aVar.vsync_len;
+
+    // Interlaced modes refresh one field, i.e. half the lines, per interval
+    if (aVar.vmode & FB_VMODE_INTERLACED) {
+        vtotal /= 2;
+    }
+    if (aVar.vmode & FB_VMODE_DOUBLE) {
+        vtotal *= 2;
+    }
+
+    // pixclock is the pixel period in picoseconds
+    uint64_t ps = uint64_t(aVar.pixclock) * htotal * vtotal;
+    std::chrono::nanoseconds ns(ps / 1000);
+    // Like the driver, no mode refreshes faster than 1000 Hz
+    if ((ns > ns.zero()) && (ns < std::chrono::milliseconds(1))) {
+        ns = std::chrono::milliseconds(1);
+    }
+    return std::chrono::duration_cast<Clock::duration>(ns);
+}
@@ -0,0 +1,99 @@
+/*
+ * FrameScheduler.h
+ *
+ * Copyright (C) 2021 RSP Systems <software@rspsystems.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef FRAMESCHEDULER_H_
+#define FRAMESCHEDULER_H_
+
+#include <chrono>
+#include <cstdint>
+#include <linux/fb.h>
+
+/**
+ * \class FrameScheduler
+ * \brief Paces frame conversion to at most one frame per refresh interval.
+ *
+ *        A notification arriving at least one interval after the previous
+ *        frame is converted at once. Notifications arriving sooner are
+ *        coalesced, and converted together when a timerfd expires at the
+ *        end of the interval. Add the file descriptor from GetFd() to the
+ *        Epoll of the thread.
+ */
+class FrameScheduler
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    FrameScheduler();
+    virtual ~FrameScheduler();
+
+    /**
+     * \fn void SetInterval(Clock::duration)
+     * \brief Set the minimum time between frames.
+     */
+    void SetInterval(Clock::duration aInterval);
+    Clock::duration GetInterval() const { return mInterval; }
+
+    /**
+     * \fn bool Notify()
+     * \brief Called for each notification from the view device.
+     *
+     * \return true if a frame should be converted now, otherwise the timer is armed
+     */
+    bool Notify();
+
+    /**
+     * \fn bool Expired()
+     * \brief Called when the timer file descriptor is readable.
+     *
+     * \return true if notifications are waiting to be converted
+     */
+    bool Expired();
+
+    /**
+     * \fn void FrameDone()
+     * \brief Called when a frame has been converted.
+     */
+    void FrameDone();
+
+    int GetFd() const { return mFd; }
+
+    uint64_t GetNotifications() const { return mNotifications; }
+    /** Notifications that did not get a frame of their own */
+    uint64_t GetCoalesced() const { return mNotifications - mPacedFrames; }
+
+    /**
+     * \fn Clock::duration GetRefreshInterval(const struct fb_var_screeninfo&)
+     * \brief Frame time of a video mode, from pixclock and the margins, at least 1 ms.
+     *
+     * \return The frame time, or zero if the mode has no timings
+     */
+    static Clock::duration GetRefreshInterval(const struct fb_var_screeninfo &aVar);
+
+protected:
+    int mFd;
+    Clock::duration mInterval = std::chrono::milliseconds(16);
+    Clock::time_point mLastFrame;
+    bool mPending = false;
+    bool mArmed = false;
+    uint64_t mNotifications = 0;
+    uint64_t mPacedFrames = 0;
+
+    void Arm(Clock::time_point aExpiry);
+};
+
+#endif /* FRAMESCHEDULER_H_ */
@@ -19,88 +19,381 @@
 
 #include <SDL2pp/SDL2pp.hh>
 #include <SDL2/SDL.h>
+#include <SDL2/SDL_syswm.h>
 #include <cstring>
 #include <algorithm>
+#include <iostream>
+#include <stdexcept>
 #include "FramebufferViewSDL.h"
 #include "log.h"
 
 using namespace SDL2pp;
 
-FramebufferViewSDL::FramebufferViewSDL(const std::string aFrameBufferName, const std::string aViewDeviceName)
-    : ViewBase(aFrameBufferName, aViewDeviceName)
+FramebufferViewSDL::FramebufferViewSDL(const std::string aFrameBufferName, const std::string aViewDeviceName, const ViewOptions &aOptions)
+    : ViewBase(aFrameBufferName, aViewDeviceName, aOptions)
 {
     mpSdl = new SDL(SDL_INIT_VIDEO);
+    SDL_AddEventWatch(eventWatch, &mEventReady);
 
-    mpWindow = new Window("Framebuffer Emulator",
+    Uint32 flags = SDL_WINDOW_SHOWN | SDL_WINDOW_MOUSE_FOCUS | SDL_WINDOW_MOUSE_CAPTURE;
+    if (aOptions.scaleFilter != Scaler::Filter::None) {
+        flags |= SDL_WINDOW_RESIZABLE | SDL_WINDOW_ALLOW_HIGHDPI;
+    }
+    mpWindow = new SDL2pp::Window("Framebuffer Emulator - " + aFrameBufferName,
             SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
-            480, 800,
-            SDL_WINDOW_SHOWN | SDL_WINDOW_MOUSE_FOCUS | SDL_WINDOW_MOUSE_CAPTURE);
+            480, 800, flags);
 
     // Create accelerated video renderer with default driver
-    mpRenderer = new Renderer(*mpWindow, -1, SDL_RENDERER_ACCELERATED);
-    mpRenderer->SetDrawBlendMode(SDL_BLENDMODE_NONE);
+    try {
+        mpRenderer = new Renderer(*mpWindow, -1, SDL_RENDERER_ACCELERATED);
+    }
+    catch (const SDL2pp::Exception &e) {
+        std::clog << "No accelerated renderer: " << e.GetSDLError() << std::endl;
+    }
+
+    if (mpRenderer) {
+        SDL_RendererInfo info;
+        mpRenderer->GetInfo(info);
+        std::clog << "Renderer: " << info.name << std::endl;
+
+        // A software renderer would only add a copy on the way to the window surface
+        if (info.flags & SDL_RENDERER_SOFTWARE) {
+            delete mpRenderer;
+            mpRenderer = nullptr;
+        }
+    }
+
+    if (mpRenderer) {
+        mpRenderer->SetDrawBlendMode(SDL_BLENDMODE_NONE);
+        mMaxPages = cPAGE_CACHE_SIZE;
+    }
 
-    mpTexture = new Texture(*mpRenderer, SDL_PIXELFORMAT_XBGR8888, SDL_TEXTUREACCESS_STREAMING, 480, 800);
-//    mpTexture->SetBlendMode(SDL_BLENDMODE_BLEND);
+    if (aOptions.scaleFilter == Scaler::Filter::Bilinear) {
+        // Bilinear output pixels blend with the next frame pixel
+        mDamageMargin = 1;
+    }
 }
 
 FramebufferViewSDL::~FramebufferViewSDL()
 {
-    delete mpTexture;
+    DeleteTextures();
     delete mpRenderer;
     delete mpWindow;
+    SDL_DelEventWatch(eventWatch, &mEventReady);
     delete mpSdl;
 }
 
 /**
- * \fn void Render()
- * \brief Render the entire buffer contents in the window
+ * \fn void Upload(const Frame&)
+ * \brief Copy the damaged parts of the frame to the texture of its page,
+ *        or to the window surface
  *
  */
-void FramebufferViewSDL::Render()
+void FramebufferViewSDL::Upload(const Frame &aFrame)
 {
-    {
-        auto lock = mpTexture->Lock();
-        uint32_t* pixels = static_cast<uint32_t*>(lock.GetPixels());
+    LOG("xres: ", aFrame.var.xres, ", xoffset: ", aFrame.var.xoffset);
+    LOG("yres: ", aFrame.var.yres, ", yoffset: ", aFrame.var.yoffset);
+    LOG("bits_per_pixel: ", aFrame.var.bits_per_pixel, ", pitch: ", aFrame.pitch, "\n");
 
-        LOG("xres: ", mFbVar.xres, ", xoffset: ", mFbVar.xoffset);
-        LOG("yres: ", mFbVar.yres, ", yoffset: ", mFbVar.yoffset);
-        LOG("bits_per_pixel: ", mFbVar.bits_per_pixel, ", line_length: ", mFbFix.line_length, "\n");
+    LogUploadPath(aFrame);
 
-        for (uint32_t y = 0 ; y < mFbVar.yres ; y++) {
-            long location;
-            for (uint32_t x = 0 ; x < mFbVar.xres ; x++) {
-                location = ((x + mFbVar.xoffset) * (mFbVar.bits_per_pixel / 8)) + ((y + mFbVar.yoffset) * mFbFix.line_length);
-                pixels[x + (y * mFbVar.xres)] = *(mpBuffer + (location / 4));
-            }
-//            LOG("y: ", y, ", location: ", location);
+    std::vector<Damage::Rect> rects = aFrame.damage.GetRects(aFrame.var.xres, aFrame.var.yres);
+    const uint8_t *pixels = aFrame.pPixels;
+    const uint8_t *wrapped = aFrame.pWrapped;
+    uint32_t wrap_row = aFrame.wrapRow;
+    int width = aFrame.var.xres;
+    int height = aFrame.var.yres;
+    int pitch = aFrame.pitch;
+
+    if (mScaler.IsEnabled()) {
+        rects = ScaleRects(aFrame, rects);
+        pixels = reinterpret_cast<const uint8_t*>(mScaled.data());
+        wrapped = nullptr;
+        wrap_row = UINT32_MAX;
+        width = mScaler.GetWidth();
+        height = mScaler.GetHeight();
+        pitch = width * 4;
+    }
+
+    if (mpRenderer) {
+        UploadTexture(aFrame.pageIndex, pixels, wrapped, wrap_row, pitch, rects, aFrame.damage.IsFull());
+    } else {
+        UploadSurface(pixels, wrapped, wrap_row, width, height, pitch, rects);
+    }
+}
+
+void FramebufferViewSDL::Present()
+{
+    if (mpRenderer) {
+        if (mScaler.IsEnabled()) {
+            // Borders around the frame, when the aspect ratios differ
+            mpRenderer->Clear();
+            mpRenderer->Copy(GetPageTexture(mPresentPage), NullOpt,
+                Rect(mScaler.GetX(), mScaler.GetY(), mScaler.GetWidth(), mScaler.GetHeight()));
+        } else {
+            mpRenderer->Copy(GetPageTexture(mPresentPage));
+        }
+        mpRenderer->Present();
+    } else {
+        SDL_UpdateWindowSurfaceRects(mpWindow->Get(), mUpdatedRects.data(), mUpdatedRects.size());
+        mUpdatedRects.clear();
+    }
+}
+
+void FramebufferViewSDL::UploadTexture(size_t aPageIndex, const uint8_t *apPixels, const uint8_t *apWrapped, uint32_t aWrapRow, int aPitch,
+    const std::vector<Damage::Rect> &aRects, bool aFull)
+{
+    Texture &texture = GetPageTexture(aPageIndex, aFull);
+    mPresentPage = aPageIndex;
+
+    // Rows of a wrapped page are contiguous on each side of the wrap
+    for (const Damage::Rect &r : Damage::SplitRows(aRects, aWrapRow)) {
+        const uint8_t *row = (r.y < aWrapRow) ? apPixels + (r.y * aPitch) : apWrapped + ((r.y - aWrapRow) * aPitch);
+        // Zero copy when the frame points into the mmap'ed frame buffer
+        texture.Update(Rect(r.x, r.y, r.w, r.h), row + (r.x * 4), aPitch);
+    }
+}
+
+void FramebufferViewSDL::UploadSurface(const uint8_t *apPixels, const uint8_t *apWrapped, uint32_t aWrapRow, int aWidth, int aHeight, int aPitch,
+    const std::vector<Damage::Rect> &aRects)
+{
+    SDL_Surface *window = SDL_GetWindowSurface(mpWindow->Get());
+    if (!window) {
+        throw std::runtime_error(std::string("Failed to get window surface: ") + SDL_GetError());
+    }
+
+    // One surface for each span of a wrapped page
+    uint32_t rows = std::min(uint32_t(aHeight), aWrapRow);
+    SDL_Surface *sources[2] = {};
+    sources[0] = SDL_CreateRGBSurfaceWithFormatFrom(const_cast<uint8_t*>(apPixels),
+        aWidth, rows, 32, aPitch, SDL_PIXELFORMAT_XBGR8888);
+    if (sources[0] && (rows < uint32_t(aHeight))) {
+        sources[1] = SDL_CreateRGBSurfaceWithFormatFrom(const_cast<uint8_t*>(apWrapped),
+            aWidth, aHeight - rows, 32, aPitch, SDL_PIXELFORMAT_XBGR8888);
+        if (!sources[1]) {
+            SDL_FreeSurface(sources[0]);
+            sources[0] = nullptr;
+        }
+    }
+    if (!sources[0]) {
+        throw std::runtime_error(std::string("Failed to create surface: ") + SDL_GetError());
+    }
+
+    for (const Damage::Rect &r : Damage::SplitRows(aRects, rows)) {
+        bool lower = r.y >= rows;
+        SDL_Rect src = { int(r.x), int(lower ? r.y - rows : r.y), int(r.w), int(r.h) };
+        SDL_Rect dst = { int(r.x + mScaler.GetX()), int(r.y + mScaler.GetY()), int(r.w), int(r.h) };
+        SDL_BlitSurface(sources[lower], &src, window, &dst);
+        mUpdatedRects.push_back(dst);
+    }
+
+    SDL_FreeSurface(sources[0]);
+    if (sources[1]) {
+        SDL_FreeSurface(sources[1]);
+    }
+}
+
+std::vector<Damage::Rect> FramebufferViewSDL::ScaleRects(const Frame &aFrame, const std::vector<Damage::Rect> &aRects)
+{
+    std::vector<Damage::Rect> scaled;
+    const int pitch = mScaler.GetWidth() * 4;
+
+    for (const Damage::Rect &r : aRects) {
+        Damage::Rect d = mScaler.MapRect(r);
+        if (!d.w || !d.h) {
+            continue;
+        }
+        uint32_t *dst = mScaled.data() + (size_t(d.y) * mScaler.GetWidth()) + d.x;
+        mScaler.Scale(dst, pitch, aFrame.pPixels, aFrame.pWrapped, aFrame.wrapRow, aFrame.pitch, d);
+        scaled.push_back(d);
+    }
+    return scaled;
+}
+
+void FramebufferViewSDL::UpdateOutput()
+{
+    int width;
+    int height;
+    SDL_Surface *window = nullptr;
+    if (mpRenderer) {
+        Point size = mpRenderer->GetOutputSize();
+        width = size.x;
+        height = size.y;
+    } else {
+        window = SDL_GetWindowSurface(mpWindow->Get());
+        if (!window) {
+            throw std::runtime_error(std::string("Failed to get window surface: ") + SDL_GetError());
         }
+        width = window->w;
+        height = window->h;
+    }
+
+    if ((width == mOutputWidth) && (height == mOutputHeight)) {
+        return;
+    }
+
+    LOG("UpdateOutput(", width, ", ", height, ")");
+
+    mOutputWidth = width;
+    mOutputHeight = height;
+    mScaler.Configure(mOptions.scaleFilter, mWidth, mHeight, width, height);
+    mScaled.assign(size_t(mScaler.GetWidth()) * mScaler.GetHeight(), 0);
+    // Textures of the old scaled size only come back if the window does
+    ReleaseTextures();
+
+    if (window) {
+        SDL_FillRect(window, nullptr, 0);
+        mUpdatedRects.push_back({ 0, 0, width, height });
+    }
+
+    if (mScalerKernel != mScaler.GetKernelName()) {
+        mScalerKernel = mScaler.GetKernelName();
+        std::clog << "Scaler: " << mScalerKernel << std::endl;
+    }
+
+    // Nothing of the old scaled frame can be reused
+    RequestRedraw();
+}
+
+void FramebufferViewSDL::LogUploadPath(const Frame &aFrame)
+{
+    bool zero_copy = aFrame.pPixels != reinterpret_cast<const uint8_t*>(aFrame.staging.data());
+    const char *path;
+    if (mScaler.IsEnabled()) {
+        // Upload() always reads the scaled copy
+        path = mpRenderer ? "texture update from scaled copy" : "window surface blit from scaled copy";
+    } else if (mpRenderer) {
+        path = zero_copy ? "texture update from frame buffer (zero copy)" : "texture update from staging";
+    } else {
+        path = zero_copy ? "window surface blit from frame buffer" : "window surface blit from staging";
+    }
+
+    if (path != mpUploadPath) {
+        std::clog << "Upload path: " << path << std::endl;
+        mpUploadPath = path;
     }
-//    mpRenderer->Clear();
-    mpRenderer->Copy(*mpTexture);
-    mpRenderer->Present();
 }
 
 void FramebufferViewSDL::Resize(int aWidth, int aHeight)
 {
-    if ((aWidth == mpWindow->GetWidth()) && (aHeight == mpWindow->GetHeight())) {
+    if ((aWidth == mWidth) && (aHeight == mHeight)) {
         return;
     }
 
     LOG("Resize(", aWidth, ", ", aHeight, ")");
 
+    mWidth = aWidth;
+    mHeight = aHeight;
+    if (mOptions.scaleFilter != Scaler::Filter::None) {
+        mpWindow->SetSize(aWidth * mOptions.zoom, aHeight * mOptions.zoom);
+        mOutputWidth = 0;
+        UpdateOutput();
+        return;
+    }
     mpWindow->SetSize(aWidth, aHeight);
-    delete mpTexture;
-    mpTexture = new Texture(*mpRenderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, aWidth, aHeight);
-//    mpTexture->SetBlendMode(SDL_BLENDMODE_BLEND);
+    // Pages get textures of the new size when they are rendered. Apps that
+    // toggle between modes get their old textures back from the pool.
+    ReleaseTextures();
+}
+
+Texture& FramebufferViewSDL::GetPageTexture(size_t aPageIndex, bool aFullUpload)
+{
+    if (mTextures.size() <= aPageIndex) {
+        mTextures.resize(aPageIndex + 1, nullptr);
+    }
+    if (!mTextures[aPageIndex]) {
+        int width = mScaler.IsEnabled() ? int(mScaler.GetWidth()) : mWidth;
+        int height = mScaler.IsEnabled() ? int(mScaler.GetHeight()) : mHeight;
+        // The newest pooled texture of the right size
+        auto pooled = std::find_if(mTexturePool.rbegin(), mTexturePool.rend(), [width, height](Texture *apTexture) {
+            return (apTexture->GetWidth() == width) && (apTexture->GetHeight() == height);
+        });
+        if (pooled != mTexturePool.rend()) {
+            mTextures[aPageIndex] = *pooled;
+            mTexturePool.erase(std::next(pooled).base());
+        } else {
+            // Same format as the RowConverter output
+            mTextures[aPageIndex] = new Texture(*mpRenderer, SDL_PIXELFORMAT_XBGR8888, SDL_TEXTUREACCESS_STREAMING, width, height);
+//            mTextures[aPageIndex]->SetBlendMode(SDL_BLENDMODE_BLEND);
+        }
+        // A pooled texture holds whatever page used it last, and a new one
+        // nothing, while frames converted before may only carry the damage
+        if (!aFullUpload) {
+            RequestRedraw();
+        }
+    }
+    return *mTextures[aPageIndex];
+}
+
+void FramebufferViewSDL::ReleaseTextures()
+{
+    for (Texture *texture : mTextures) {
+        if (texture) {
+            mTexturePool.push_back(texture);
+        }
+    }
+    mTextures.clear();
+
+    while (mTexturePool.size() > cTEXTURE_POOL_SIZE) {
+        delete mTexturePool.front();
+        mTexturePool.erase(mTexturePool.begin());
+    }
+}
+
+void FramebufferViewSDL::DeleteTextures()
+{
+    ReleaseTextures();
+    for (Texture *texture : mTexturePool) {
+        delete texture;
+    }
+    mTexturePool.clear();
+}
+
+bool FramebufferViewSDL::AddEventSources(Epoll &arEpoll)
+{
+    // Events pushed to the SDL queue, e.g. from other threads
+    arEpoll.Add(mEventReady.GetFd(), EPOLLIN);
+
+    // Window system events only enter the SDL queue when PollEvents() pumps
+    // them, so also wait for data on the window system connection.
+    SDL_SysWMinfo info;
+    SDL_VERSION(&info.version);
+    if (SDL_GetWindowWMInfo(mpWindow->Get(), &info)) {
+#ifdef SDL_VIDEO_DRIVER_X11
+        if (info.subsystem == SDL_SYSWM_X11) {
+            arEpoll.Add(ConnectionNumber(info.info.x11.display), EPOLLIN);
+            return true;
+        }
+#endif
+    }
+
+    std::clog << "Window system connection not available, polling for events" << std::endl;
+    return false;
+}
+
+int FramebufferViewSDL::eventWatch(void *apUserData, [[maybe_unused]] SDL_Event *apEvent)
+{
+    try {
+        static_cast<EventFd*>(apUserData)->Signal();
+    }
+    catch (...) {
+        // Never throw into SDL. The event is still handled on the next wakeup.
+    }
+    return 0;
 }
 
 bool FramebufferViewSDL::PollEvents()
 {
+    mEventReady.Clear();
+
     SDL_Event event;
     while (SDL_PollEvent(&event)) {
         if (event.type == SDL_QUIT) {
             return false;
+        } else if ((event.type == SDL_WINDOWEVENT) && (event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED)) {
+            if (mScaler.IsEnabled()) {
+                UpdateOutput();
+            }
         } else if (event.type == SDL_KEYDOWN) {
             switch (event.key.keysym.sym) {
                 case SDLK_ESCAPE:
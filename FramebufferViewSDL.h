@@ -21,6 +21,7 @@
 
 #include <SDL2pp/SDL2pp.hh>
 #include <string>
+#include <vector>
 #include "ViewBase.h"
 
 /**
@@ -28,24 +29,80 @@
  * \brief Viewer implementation utilizing the SDL2 framework.
  *        Frame buffer content is copied directly into a
  *        SDL_Texture element, and then rendered in the top
- *        window.
+ *        window. Each page of the virtual screen gets its own
+ *        texture, so flipping back to a page only uploads what
+ *        changed on it. Without an accelerated renderer the
+ *        content is blitted into the window surface instead.
+ *
+ *        With a scaling filter the window is resizable, and the frame
+ *        is scaled to the drawable size of the window by the Scaler,
+ *        so HiDPI displays get every physical pixel. Only the scaled
+ *        areas of damaged rectangles are computed, and the textures
+ *        hold the scaled pages, so a page without damage costs nothing.
  *
  */
 class FramebufferViewSDL : public ViewBase
 {
 public:
-    FramebufferViewSDL(const std::string aFrameBufferName, const std::string aViewDeviceName);
+    FramebufferViewSDL(const std::string aFrameBufferName, const std::string aViewDeviceName, const ViewOptions &aOptions);
     virtual ~FramebufferViewSDL();
 
     void Resize(int aWidth, int aHeight) override;
-    void Render() override;
+    void Upload(const Frame &aFrame) override;
+    void Present() override;
     bool PollEvents() override;
+    bool AddEventSources(Epoll &arEpoll) override;
 
 protected:
+    /** Number of pages kept as textures */
+    static const size_t cPAGE_CACHE_SIZE = 4;
+    /** Number of textures kept from earlier modes */
+    static const size_t cTEXTURE_POOL_SIZE = 8;
+
     SDL2pp::SDL *mpSdl;
     SDL2pp::Window *mpWindow;
-    SDL2pp::Renderer *mpRenderer;
-    SDL2pp::Texture *mpTexture;
+    SDL2pp::Renderer *mpRenderer = nullptr;
+    /** Texture per cached page, indexed like mPages */
+    std::vector<SDL2pp::Texture*> mTextures;
+    /** Textures released by a mode change, oldest first, reused by a mode of their size */
+    std::vector<SDL2pp::Texture*> mTexturePool;
+    /** Page index of the last uploaded frame */
+    size_t mPresentPage = 0;
+    /** Window surface areas updated since the last present */
+    std::vector<SDL_Rect> mUpdatedRects;
+
+    int mWidth = 480;
+    int mHeight = 800;
+    /** Drawable size of the window the scaler is configured for */
+    int mOutputWidth = 0;
+    int mOutputHeight = 0;
+    Scaler mScaler;
+    /** The scaled frame, current in the areas scaled by the last upload */
+    std::vector<uint32_t> mScaled;
+    std::string mScalerKernel;
+    const char *mpUploadPath = nullptr;
+    /** Signaled by an SDL event watch whenever an event enters the SDL queue */
+    EventFd mEventReady;
+
+    static int eventWatch(void *apUserData, SDL_Event *apEvent);
+
+    void UploadTexture(size_t aPageIndex, const uint8_t *apPixels, const uint8_t *apWrapped, uint32_t aWrapRow, int aPitch,
+        const std::vector<Damage::Rect> &aRects, bool aFull);
+    void UploadSurface(const uint8_t *apPixels, const uint8_t *apWrapped, uint32_t aWrapRow, int aWidth, int aHeight, int aPitch,
+        const std::vector<Damage::Rect> &aRects);
+    std::vector<Damage::Rect> ScaleRects(const Frame &aFrame, const std::vector<Damage::Rect> &aRects);
+    void UpdateOutput();
+    /**
+     * \fn SDL2pp::Texture& GetPageTexture(size_t, bool)
+     * \brief The texture of a page, taken from the pool or created if it has none.
+     *
+     * \param aFullUpload The caller uploads the whole page, otherwise a page
+     *        that gets a texture is converted again in full
+     */
+    SDL2pp::Texture& GetPageTexture(size_t aPageIndex, bool aFullUpload = false);
+    void ReleaseTextures();
+    void DeleteTextures();
+    void LogUploadPath(const Frame &aFrame);
 };
 
 #endif /* FRAMEBUFFERVIEWSDL_H_ */
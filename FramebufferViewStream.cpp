@@ -0,0 +1,220 @@
+/*
+ * FramebufferViewStream.cpp
+ *
+ * Copyright (C) 2021 RSP Systems <software@rspsystems.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <iostream>
+#include <stdexcept>
+#include <system_error>
+#include <csignal>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+#include "FramebufferViewStream.h"
+#include "log.h"
+
+FramebufferViewStream::FramebufferViewStream(const std::string aFrameBufferName, const std::string aViewDeviceName, const ViewOptions &aOptions)
+    : ViewBase(aFrameBufferName, aViewDeviceName, aOptions)
+{
+    // A closed pipe is reported by write(), not by killing the process
+    std::signal(SIGPIPE, SIG_IGN);
+
+    if (mOptions.outputPath == "-") {
+        mOutputFd = STDOUT_FILENO;
+    } else {
+        // Opening a FIFO blocks until a reader opens it too, so this is done
+        // before the signals are blocked, to keep Ctrl-C working meanwhile
+        mOutputFd = open(mOptions.outputPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (mOutputFd == -1) {
+            throw std::system_error(errno, std::generic_category(), "Failed to open " + mOptions.outputPath);
+        }
+        mCloseOutput = true;
+    }
+
+    // Blocked before run() starts the conversion thread, so the thread
+    // inherits the mask and the signals are only seen through mSignalFd
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    if (pthread_sigmask(SIG_BLOCK, &signals, nullptr) != 0) {
+        throw std::runtime_error("Failed to block signals");
+    }
+    mSignalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (mSignalFd == -1) {
+        throw std::system_error(errno, std::generic_category(), "Failed to create signalfd");
+    }
+
+    // Y4M has a fixed frame rate, but frames are only written when the screen changes, so the
+    // mode pacing (e.g. 352 Hz for the default vfb2 mode) would only make playback run fast
+    double hz = (mOptions.refreshRate > 0) ? mOptions.refreshRate : 60.0;
+    mMilliHertz = std::max<uint64_t>(std::llround(hz * 1000.0 / mOptions.decimation), 1);
+
+    std::clog << "Streaming " << (mOptions.y4m ? "Y4M" : "raw RGBA") << " to " << mOptions.outputPath
+              << ", writing 1 of every " << mOptions.decimation << " frames" << std::endl;
+}
+
+FramebufferViewStream::~FramebufferViewStream()
+{
+    std::clog << "Stream: " << mWritten << " of " << mPresented << " frames written" << std::endl;
+
+    if (mCloseOutput) {
+        close(mOutputFd);
+    }
+    close(mSignalFd);
+}
+
+void FramebufferViewStream::Resize(int aWidth, int aHeight)
+{
+    if ((uint32_t(aWidth) == mWidth) && (uint32_t(aHeight) == mHeight)) {
+        return;
+    }
+
+    LOG("Resize(", aWidth, ", ", aHeight, ")");
+
+    if (mHeaderWritten) {
+        throw std::runtime_error("The video mode changed, a Y4M stream can not change size");
+    }
+
+    mWidth = aWidth;
+    mHeight = aHeight;
+    size_t pixels = size_t(mWidth) * mHeight;
+    if (mOptions.y4m) {
+        mPlanes.assign(pixels * 3, 0);
+    } else {
+        mImage.assign(pixels, 0);
+    }
+}
+
+/**
+ * \fn void Upload(const Frame&)
+ * \brief Convert the damaged parts of the frame into the output image
+ *
+ */
+void FramebufferViewStream::Upload(const Frame &aFrame)
+{
+    std::vector<Damage::Rect> rects = aFrame.damage.GetRects(aFrame.var.xres, aFrame.var.yres);
+    for (const Damage::Rect &r : rects) {
+        if (mOptions.y4m) {
+            UploadY4M(aFrame, r);
+        } else {
+            UploadRGBA(aFrame, r);
+        }
+    }
+}
+
+void FramebufferViewStream::UploadRGBA(const Frame &aFrame, const Damage::Rect &arRect)
+{
+    for (uint32_t y = arRect.y ; y < arRect.y + arRect.h ; y++) {
+        const uint32_t *src = reinterpret_cast<const uint32_t*>(aFrame.GetRow(y)) + arRect.x;
+        uint32_t *dst = mImage.data() + (size_t(y) * mWidth) + arRect.x;
+        // Frames are R, G, B, X in memory, make X an opaque alpha
+        for (uint32_t x = 0 ; x < arRect.w ; x++) {
+            dst[x] = src[x] | 0xFF000000;
+        }
+    }
+}
+
+void FramebufferViewStream::UploadY4M(const Frame &aFrame, const Damage::Rect &arRect)
+{
+    const size_t plane = size_t(mWidth) * mHeight;
+    for (uint32_t y = arRect.y ; y < arRect.y + arRect.h ; y++) {
+        const uint8_t *src = aFrame.GetRow(y) + (arRect.x * 4);
+        size_t offset = (size_t(y) * mWidth) + arRect.x;
+        uint8_t *luma = mPlanes.data() + offset;
+        uint8_t *cb = luma + plane;
+        uint8_t *cr = cb + plane;
+        // BT.601 limited range, in 8-bit fixed point
+        for (uint32_t x = 0 ; x < arRect.w ; x++, src += 4) {
+            int r = src[0];
+            int g = src[1];
+            int b = src[2];
+            luma[x] = uint8_t((((66 * r) + (129 * g) + (25 * b) + 128) >> 8) + 16);
+            cb[x] = uint8_t((((-38 * r) - (74 * g) + (112 * b) + 128) >> 8) + 128);
+            cr[x] = uint8_t((((112 * r) - (94 * g) - (18 * b) + 128) >> 8) + 128);
+        }
+    }
+}
+
+void FramebufferViewStream::Present()
+{
+    if (mOutputClosed || ((mPresented++ % mOptions.decimation) != 0)) {
+        return;
+    }
+
+    bool written;
+    if (mOptions.y4m) {
+        if (!mHeaderWritten) {
+            std::string header = "YUV4MPEG2 W" + std::to_string(mWidth) + " H" + std::to_string(mHeight)
+                + " F" + std::to_string(mMilliHertz) + ":1000 Ip A1:1 C444\n";
+            mHeaderWritten = true;
+            if (!Write(header.data(), header.size())) {
+                return;
+            }
+        }
+        static const char cFRAME[] = "FRAME\n";
+        written = Write(cFRAME, sizeof(cFRAME) - 1) && Write(mPlanes.data(), mPlanes.size());
+    } else {
+        written = Write(mImage.data(), mImage.size() * sizeof(uint32_t));
+    }
+
+    if (written) {
+        mWritten++;
+    }
+}
+
+bool FramebufferViewStream::Write(const void *apData, size_t aSize)
+{
+    const uint8_t *data = static_cast<const uint8_t*>(apData);
+    while (aSize) {
+        ssize_t ret = write(mOutputFd, data, aSize);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EPIPE) {
+                std::clog << "Output closed by the reader" << std::endl;
+                mOutputClosed = true;
+                return false;
+            }
+            throw std::system_error(errno, std::generic_category(), "Failed to write frame");
+        }
+        data += ret;
+        aSize -= ret;
+    }
+    return true;
+}
+
+bool FramebufferViewStream::AddEventSources(Epoll &arEpoll)
+{
+    arEpoll.Add(mSignalFd, EPOLLIN);
+    return true;
+}
+
+bool FramebufferViewStream::PollEvents()
+{
+    struct signalfd_siginfo info;
+    if (read(mSignalFd, &info, sizeof(info)) == sizeof(info)) {
+        std::clog << "Stopped by signal " << info.ssi_signo << std::endl;
+        return false;
+    }
+    return !mOutputClosed;
+}
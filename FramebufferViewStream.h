@@ -0,0 +1,83 @@
+/*
+ * FramebufferViewStream.h
+ *
+ * Copyright (C) 2021 RSP Systems <software@rspsystems.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef FRAMEBUFFERVIEWSTREAM_H_
+#define FRAMEBUFFERVIEWSTREAM_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "ViewBase.h"
+
+/**
+ * \class FramebufferViewStream
+ * \brief Headless viewer implementation, writing every presented frame to a
+ *        file, pipe or FIFO instead of a window, so the render pipeline can
+ *        run without a display server.
+ *
+ *        The output is a sequence of raw RGBA frames, or a Y4M stream with
+ *        4:4:4 chroma. Only the damaged areas of a frame are converted into
+ *        the output image, and every frame is written in full. SIGINT and
+ *        SIGTERM end the view, so the statistics are still printed.
+ */
+class FramebufferViewStream : public ViewBase
+{
+public:
+    FramebufferViewStream(const std::string aFrameBufferName, const std::string aViewDeviceName, const ViewOptions &aOptions);
+    virtual ~FramebufferViewStream();
+
+    void Resize(int aWidth, int aHeight) override;
+    void Upload(const Frame &aFrame) override;
+    void Present() override;
+    bool PollEvents() override;
+    bool AddEventSources(Epoll &arEpoll) override;
+
+protected:
+    int mOutputFd = -1;
+    bool mCloseOutput = false;
+    /** Signal file descriptor for SIGINT and SIGTERM */
+    int mSignalFd = -1;
+    /** The reader of the output has gone away */
+    bool mOutputClosed = false;
+
+    uint32_t mWidth = 0;
+    uint32_t mHeight = 0;
+    /** Raw output: The current frame as RGBA bytes */
+    std::vector<uint32_t> mImage;
+    /** Y4M output: The current frame as Y, Cb and Cr planes */
+    std::vector<uint8_t> mPlanes;
+    bool mHeaderWritten = false;
+    /** Frames per second written to the Y4M header, in thousandths */
+    uint64_t mMilliHertz = 60000;
+
+    uint64_t mPresented = 0;
+    uint64_t mWritten = 0;
+
+    void UploadRGBA(const Frame &aFrame, const Damage::Rect &arRect);
+    void UploadY4M(const Frame &aFrame, const Damage::Rect &arRect);
+
+    /**
+     * \fn bool Write(const void*, size_t)
+     * \brief Write all bytes to the output, retrying partial writes.
+     *
+     * \return false if the reader has closed the pipe
+     */
+    bool Write(const void *apData, size_t aSize);
+};
+
+#endif /* FRAMEBUFFERVIEWSTREAM_H_ */
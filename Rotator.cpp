@@ -0,0 +1,360 @@
+/*
+ * Rotator.cpp
+ *
+ * Copyright (C) 2021 RSP Systems <software@rspsystems.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <stdexcept>
+#include <linux/fb.h>
+#include "Rotator.h"
+#include "RowConverter.h"
+#include "log.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #define ROTATOR_X86
+    #include <immintrin.h>
+#endif
+
+/*
+ * Width and height of the tiles a rectangle is rotated in. A source and an
+ * output tile take 8 KiB together, so both stay in the L1 cache while the
+ * columns of one are written as rows of the other.
+ */
+static const uint32_t cTILE_SIZE = 32;
+
+/*
+ * Tile kernels work in tile coordinates. A source pixel (x, y) of a w x h
+ * tile goes to output pixel:
+ *   FB_ROTATE_CW:  (y, w - 1 - x)
+ *   FB_ROTATE_UD:  (w - 1 - x, h - 1 - y)
+ *   FB_ROTATE_CCW: (h - 1 - y, x)
+ * The vector kernels handle whole blocks, and leave the right and bottom
+ * edges of the tile to rotateEdges().
+ */
+template<uint32_t R>
+static inline void rotatePixels(uint32_t *apDst, uint32_t aDstPitch, const uint32_t *apSrc, uint32_t aSrcPitch,
+    uint32_t aWidth, uint32_t aHeight, uint32_t aX0, uint32_t aX1, uint32_t aY0, uint32_t aY1)
+{
+    for (uint32_t y = aY0 ; y < aY1 ; y++) {
+        const uint32_t *src = apSrc + (y * aSrcPitch);
+        for (uint32_t x = aX0 ; x < aX1 ; x++) {
+            if (R == FB_ROTATE_CW) {
+                apDst[((aWidth - 1 - x) * aDstPitch) + y] = src[x];
+            } else if (R == FB_ROTATE_UD) {
+                apDst[((aHeight - 1 - y) * aDstPitch) + (aWidth - 1 - x)] = src[x];
+            } else {
+                apDst[(x * aDstPitch) + (aHeight - 1 - y)] = src[x];
+            }
+        }
+    }
+}
+
+template<uint32_t R>
+static inline void rotateEdges(uint32_t *apDst, uint32_t aDstPitch, const uint32_t *apSrc, uint32_t aSrcPitch,
+    uint32_t aWidth, uint32_t aHeight, uint32_t aBlock)
+{
+    uint32_t bw = aWidth - (aWidth % aBlock);
+    uint32_t bh = aHeight - (aHeight % aBlock);
+    rotatePixels<R>(apDst, aDstPitch, apSrc, aSrcPitch, aWidth, aHeight, bw, aWidth, 0, aHeight);
+    rotatePixels<R>(apDst, aDstPitch, apSrc, aSrcPitch, aWidth, aHeight, 0, bw, bh, aHeight);
+}
+
+template<uint32_t R>
+static void tileScalar(uint32_t *apDst, uint32_t aDstPitch, const uint32_t *apSrc, uint32_t aSrcPitch,
+    uint32_t aWidth, uint32_t aHeight)
+{
+    rotatePixels<R>(apDst, aDstPitch, apSrc, aSrcPitch, aWidth, aHeight, 0, aWidth, 0, aHeight);
+}
+
+#ifdef ROTATOR_X86
+__attribute__((target("sse2")))
+static inline void transpose4SSE2(__m128i &r0, __m128i &r1, __m128i &r2, __m128i &r3)
+{
+    __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+    __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+    __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+    __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+    r0 = _mm_unpacklo_epi64(t0, t1);
+    r1 = _mm_unpackhi_epi64(t0, t1);
+    r2 = _mm_unpacklo_epi64(t2, t3);
+    r3 = _mm_unpackhi_epi64(t2, t3);
+}
+
+__attribute__((target("sse2")))
+static void tileCwSSE2(uint32_t *apDst, uint32_t aDstPitch, const uint32_t *apSrc, uint32_t aSrcPitch,
+    uint32_t aWidth, uint32_t aHeight)
+{
+    for (uint32_t y = 0 ; y + 4 <= aHeight ; y += 4) {
+        const uint32_t *src = apSrc + (y * aSrcPitch);
+        for (uint32_t x = 0 ; x + 4 <= aWidth ; x += 4) {
+            __m128i r[4];
+            for (int i = 0 ; i < 4 ; i++) {
+                r[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + (i * aSrcPitch) + x));
+            }
+            // Column x + i becomes output row w - 1 - x - i
+            transpose4SSE2(r[0], r[1], r[2], r[3]);
+            for (int i = 0 ; i < 4 ; i++) {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(apDst + ((aWidth - 1 - x - i) * aDstPitch) + y), r[i]);
+            }
+        }
+    }
+    rotateEdges<FB_ROTATE_CW>(apDst, aDstPitch, apSrc, aSrcPitch, aWidth, aHeight, 4);
+}
+
+__attribute__((target("sse2")))
+static void tileCcwSSE2(uint32_t *apDst, uint32_t aDstPitch, const uint32_t *apSrc, uint32_t aSrcPitch,
+    uint32_t aWidth, uint32_t aHeight)
+{
+    for (uint32_t y = 0 ; y + 4 <= aHeight ; y += 4) {
+        const uint32_t *src = apSrc + (y * aSrcPitch);
+        for (uint32_t x = 0 ; x + 4 <= aWidth ; x += 4) {
+            // Load the rows bottom up, so the transposed columns are reversed
+            __m128i r[4];
+            for (int i = 0 ; i < 4 ; i++) {
+                r[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + ((3 - i) * aSrcPitch) + x));
+            }
+            transpose4SSE2(r[0], r[1], r[2], r[3]);
+            for (int i = 0 ; i < 4 ; i++) {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(apDst + ((x + i) * aDstPitch) + (aHeight - 4 - y)), r[i]);
+            }
+        }
+    }
+    rotateEdges<FB_ROTATE_CCW>(apDst, aDstPitch, apSrc, aSrcPitch, aWidth, aHeight, 4);
+}
+
+__attribute__((target("sse2")))
+static void tileUdSSE2(uint32_t *apDst, uint32_t aDstPitch, const uint32_t *apSrc, uint32_t aSrcPitch,
+    uint32_t aWidth, uint32_t aHeight)
+{
+    for (uint32_t y = 0 ; y < aHeight ; y++) {
+        const uint32_t *src = apSrc + (y * aSrcPitch);
+        uint32_t *dst = apDst + ((aHeight - 1 - y) * aDstPitch);
+        for (uint32_t x = 0 ; x + 4 <= aWidth ; x += 4) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+            v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + (aWidth - 4 - x)), v);
+        }
+    }
+    // Only columns are left over, rows are done one at a time
+    rotatePixels<FB_ROTATE_UD>(apDst, aDstPitch, apSrc, aSrcPitch, aWidth, aHeight, aWidth - (aWidth % 4), aWidth, 0, aHeight);
+}
+
+__attribute__((target("avx2")))
+static inline void transpose8AVX2(__m256i *r)
+{
+    __m256i t[8];
+    for (int i = 0 ; i < 8 ; i += 2) {
+        t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+        t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+    }
+    // Each 128-bit lane now holds pairs of rows; gather them into columns
+    __m256i u[8];
+    for (int i = 0 ; i < 8 ; i += 4) {
+        u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+        u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+        u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+        u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+    }
+    for (int i = 0 ; i < 4 ; i++) {
+        r[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+        r[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+    }
+}
+
+__attribute__((target("avx2")))
+static void tileCwAVX2(uint32_t *apDst, uint32_t aDstPitch, const uint32_t *apSrc, uint32_t aSrcPitch,
+    uint32_t aWidth, uint32_t aHeight)
+{
+    for (uint32_t y = 0 ; y + 8 <= aHeight ; y += 8) {
+        const uint32_t *src = apSrc + (y * aSrcPitch);
+        for (uint32_t x = 0 ; x + 8 <= aWidth ; x += 8) {
+            __m256i r[8];
+            for (int i = 0 ; i < 8 ; i++) {
+                r[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + (i * aSrcPitch) + x));
+            }
+            transpose8AVX2(r);
+            for (int i = 0 ; i < 8 ; i++) {
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(apDst + ((aWidth - 1 - x - i) * aDstPitch) + y), r[i]);
+            }
+        }
+    }
+    rotateEdges<FB_ROTATE_CW>(apDst, aDstPitch, apSrc, aSrcPitch, aWidth, aHeight, 8);
+}
+
+__attribute__((target("avx2")))
+static void tileCcwAVX2(uint32_t *apDst, uint32_t aDstPitch, const uint32_t *apSrc, uint32_t aSrcPitch,
+    uint32_t aWidth, uint32_t aHeight)
+{
+    for (uint32_t y = 0 ; y + 8 <= aHeight ; y += 8) {
+        const uint32_t *src = apSrc + (y * aSrcPitch);
+        for (uint32_t x = 0 ; x + 8 <= aWidth ; x += 8) {
+            __m256i r[8];
+            for (int i = 0 ; i < 8 ; i++) {
+                r[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + ((7 - i) * aSrcPitch) + x));
+            }
+            transpose8AVX2(r);
+            for (int i = 0 ; i < 8 ; i++) {
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(apDst + ((x + i) * aDstPitch) + (aHeight - 8 - y)), r[i]);
+            }
+        }
+    }
+    rotateEdges<FB_ROTATE_CCW>(apDst, aDstPitch, apSrc, aSrcPitch, aWidth, aHeight, 8);
+}
+
+__attribute__((target("avx2")))
+static void tileUdAVX2(uint32_t *apDst, uint32_t aDstPitch, const uint32_t *apSrc, uint32_t aSrcPitch,
+    uint32_t aWidth, uint32_t aHeight)
+{
+    const __m256i reverse = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+    for (uint32_t y = 0 ; y < aHeight ; y++) {
+        const uint32_t *src = apSrc + (y * aSrcPitch);
+        uint32_t *dst = apDst + ((aHeight - 1 - y) * aDstPitch);
+        for (uint32_t x = 0 ; x + 8 <= aWidth ; x += 8) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x));
+            v = _mm256_permutevar8x32_epi32(v, reverse);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + (aWidth - 8 - x)), v);
+        }
+    }
+    rotatePixels<FB_ROTATE_UD>(apDst, aDstPitch, apSrc, aSrcPitch, aWidth, aHeight, aWidth - (aWidth % 8), aWidth, 0, aHeight);
+}
+#endif
+
+struct RotateKernels {
+    Rotator::TileFunc tile[4];
+    const char *name;
+};
+
+static const RotateKernels& selectKernels()
+{
+    static const RotateKernels scalar = {
+        { nullptr, tileScalar<FB_ROTATE_CW>, tileScalar<FB_ROTATE_UD>, tileScalar<FB_ROTATE_CCW> }, "scalar" };
+#ifdef ROTATOR_X86
+    static const RotateKernels sse2 = { { nullptr, tileCwSSE2, tileUdSSE2, tileCcwSSE2 }, "sse2 4x4" };
+    static const RotateKernels avx2 = { { nullptr, tileCwAVX2, tileUdAVX2, tileCcwAVX2 }, "avx2 8x8" };
+
+    if (RowConverter::GetIsa() >= RowConverter::Isa::AVX2) {
+        return avx2;
+    }
+    if (RowConverter::GetIsa() >= RowConverter::Isa::SSE2) {
+        return sse2;
+    }
+#endif
+    return scalar;
+}
+
+Rotator::Rotator()
+{
+}
+
+uint32_t Rotator::ParseRotation(const std::string &arDegrees)
+{
+    if (arDegrees == "0") {
+        return FB_ROTATE_UR;
+    }
+    if (arDegrees == "90") {
+        return FB_ROTATE_CW;
+    }
+    if (arDegrees == "180") {
+        return FB_ROTATE_UD;
+    }
+    if (arDegrees == "270") {
+        return FB_ROTATE_CCW;
+    }
+    throw std::invalid_argument("Unsupported rotation: " + arDegrees);
+}
+
+void Rotator::Configure(uint32_t aRotate)
+{
+    static const char *cNAMES[4] = { "none", "90", "180", "270" };
+    const RotateKernels &kernels = selectKernels();
+
+    mRotate = aRotate & 3;
+    mpTile = kernels.tile[mRotate];
+    mKernelName = std::string(cNAMES[mRotate]);
+    if (mpTile) {
+        mKernelName += std::string(" degrees, ") + kernels.name;
+    }
+}
+
+Damage::Rect Rotator::mapRect(uint32_t aRotate, const Damage::Rect &arRect, uint32_t aWidth, uint32_t aHeight)
+{
+    switch (aRotate) {
+        case FB_ROTATE_CW:
+            return { arRect.y, aWidth - arRect.x - arRect.w, arRect.h, arRect.w };
+        case FB_ROTATE_UD:
+            return { aWidth - arRect.x - arRect.w, aHeight - arRect.y - arRect.h, arRect.w, arRect.h };
+        case FB_ROTATE_CCW:
+            return { aHeight - arRect.y - arRect.h, arRect.x, arRect.h, arRect.w };
+        default:
+            return arRect;
+    }
+}
+
+Damage::Rect Rotator::MapRect(const Damage::Rect &arRect, uint32_t aWidth, uint32_t aHeight) const
+{
+    return mapRect(mRotate, arRect, aWidth, aHeight);
+}
+
+Damage::Rect Rotator::UnmapRect(const Damage::Rect &arRect, uint32_t aWidth, uint32_t aHeight) const
+{
+    // The opposite rotation, applied to the output
+    if (SwapsAxes()) {
+        std::swap(aWidth, aHeight);
+    }
+    return mapRect((4 - mRotate) & 3, arRect, aWidth, aHeight);
+}
+
+Damage Rotator::MapDamage(const Damage &arDamage, uint32_t aWidth, uint32_t aHeight) const
+{
+    if (arDamage.IsFull() || !IsEnabled()) {
+        return arDamage;
+    }
+    Damage damage;
+    damage.Clear();
+    for (const Damage::Rect &r : arDamage.GetRects()) {
+        damage.Add(MapRect(r, aWidth, aHeight));
+    }
+    return damage;
+}
+
+Damage Rotator::UnmapDamage(const Damage &arDamage, uint32_t aWidth, uint32_t aHeight) const
+{
+    if (arDamage.IsFull() || !IsEnabled()) {
+        return arDamage;
+    }
+    Damage damage;
+    damage.Clear();
+    for (const Damage::Rect &r : arDamage.GetRects()) {
+        damage.Add(UnmapRect(r, aWidth, aHeight));
+    }
+    return damage;
+}
+
+void Rotator::Rotate(uint32_t *apDst, int aDstPitch, const uint32_t *apSrc, int aSrcPitch, uint32_t aWidth, uint32_t aHeight) const
+{
+    const uint32_t dst_pitch = aDstPitch / sizeof(uint32_t);
+    const uint32_t src_pitch = aSrcPitch / sizeof(uint32_t);
+
+    for (uint32_t y = 0 ; y < aHeight ; y += cTILE_SIZE) {
+        uint32_t h = std::min(cTILE_SIZE, aHeight - y);
+        for (uint32_t x = 0 ; x < aWidth ; x += cTILE_SIZE) {
+            uint32_t w = std::min(cTILE_SIZE, aWidth - x);
+            Damage::Rect d = mapRect(mRotate, { x, y, w, h }, aWidth, aHeight);
+            mpTile(apDst + (d.y * dst_pitch) + d.x, dst_pitch, apSrc + (y * src_pitch) + x, src_pitch, w, h);
+        }
+    }
+}
@@ -0,0 +1,126 @@
+/*
+ * Rotator.h
+ *
+ * Copyright (C) 2021 RSP Systems <software@rspsystems.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef ROTATOR_H_
+#define ROTATOR_H_
+
+#include <cstdint>
+#include <string>
+#include "Damage.h"
+
+/**
+ * \class Rotator
+ * \brief Turns converted 32-bit pixels upright for frame buffers drawn in
+ *        the orientation of a rotated panel.
+ *
+ *        The rotation is given like fb_var_screeninfo.rotate, i.e. how the
+ *        producer rotated its content clockwise, and the output is rotated
+ *        the other way. Rectangles are walked in tiles that fit in the L1
+ *        cache, and each tile is rotated with 4x4 or 8x8 transposes when the
+ *        CPU supports SSE2 or AVX2.
+ */
+class Rotator
+{
+public:
+    /** Rows converted at a time before rotating them, a multiple of the largest transpose */
+    static const uint32_t cBAND_ROWS = 16;
+
+    Rotator();
+
+    /**
+     * \fn uint32_t ParseRotation(const std::string&)
+     * \brief FB_ROTATE_* value from degrees clockwise, "0", "90", "180" or "270".
+     *        Throws if the angle is not supported.
+     */
+    static uint32_t ParseRotation(const std::string &arDegrees);
+
+    /**
+     * \fn void Configure(uint32_t)
+     * \brief Select the tile kernel for a rotation.
+     *
+     * \param aRotate FB_ROTATE_UR, FB_ROTATE_CW, FB_ROTATE_UD or FB_ROTATE_CCW
+     */
+    void Configure(uint32_t aRotate);
+
+    /**
+     * \fn Damage::Rect MapRect(const Damage::Rect&, uint32_t, uint32_t)
+     * \brief Where an area of the frame ends up in the output.
+     *
+     * \param arRect in frame coordinates
+     * \param aWidth Frame width in pixels
+     * \param aHeight Frame height in pixels
+     */
+    Damage::Rect MapRect(const Damage::Rect &arRect, uint32_t aWidth, uint32_t aHeight) const;
+
+    /**
+     * \fn Damage::Rect UnmapRect(const Damage::Rect&, uint32_t, uint32_t)
+     * \brief Where an area of the output comes from in the frame.
+     *
+     * \param arRect in output coordinates
+     * \param aWidth Frame width in pixels
+     * \param aHeight Frame height in pixels
+     */
+    Damage::Rect UnmapRect(const Damage::Rect &arRect, uint32_t aWidth, uint32_t aHeight) const;
+
+    /**
+     * \fn Damage MapDamage(const Damage&, uint32_t, uint32_t)
+     * \brief MapRect() for every rectangle of a damage list.
+     */
+    Damage MapDamage(const Damage &arDamage, uint32_t aWidth, uint32_t aHeight) const;
+
+    /**
+     * \fn Damage UnmapDamage(const Damage&, uint32_t, uint32_t)
+     * \brief UnmapRect() for every rectangle of a damage list.
+     */
+    Damage UnmapDamage(const Damage &arDamage, uint32_t aWidth, uint32_t aHeight) const;
+
+    /**
+     * \fn void Rotate(uint32_t*, int, const uint32_t*, int, uint32_t, uint32_t)
+     * \brief Rotate a rectangle of pixels.
+     *
+     * \param apDst Address of the first output pixel of the rotated rectangle
+     * \param aDstPitch Bytes between output rows
+     * \param apSrc Address of the first pixel of the rectangle
+     * \param aSrcPitch Bytes between rows of the rectangle
+     * \param aWidth in pixels, before rotation
+     * \param aHeight in pixels, before rotation
+     */
+    void Rotate(uint32_t *apDst, int aDstPitch, const uint32_t *apSrc, int aSrcPitch, uint32_t aWidth, uint32_t aHeight) const;
+
+    bool IsEnabled() const { return mRotate != 0; }
+    /** The output is as high as the frame is wide */
+    bool SwapsAxes() const { return mRotate & 1; }
+
+    /**
+     * \fn const char* GetKernelName()
+     * \brief Name of the selected tile kernel, for logging.
+     */
+    const char* GetKernelName() const { return mKernelName.c_str(); }
+
+    typedef void (*TileFunc)(uint32_t *apDst, uint32_t aDstPitch, const uint32_t *apSrc, uint32_t aSrcPitch,
+        uint32_t aWidth, uint32_t aHeight);
+
+protected:
+    uint32_t mRotate = 0;
+    TileFunc mpTile = nullptr;
+    std::string mKernelName;
+
+    static Damage::Rect mapRect(uint32_t aRotate, const Damage::Rect &arRect, uint32_t aWidth, uint32_t aHeight);
+};
+
+#endif /* ROTATOR_H_ */
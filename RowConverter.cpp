@@ -0,0 +1,522 @@
+/*
+ * RowConverter.cpp
+ *
+ * Copyright (C) 2021 RSP Systems <software@rspsystems.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <stdexcept>
+#include "RowConverter.h"
+#include "log.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #define ROWCONVERTER_X86
+    #include <immintrin.h>
+#endif
+
+typedef RowConverter::Params Params;
+
+/** Output alpha for formats without a transparency channel */
+static const uint32_t cOPAQUE = 0xFF000000;
+
+/*
+ * 32 bpp kernels. Output byte i is taken from source byte shuffle[i], or
+ * cleared if shuffle[i] has bit 7 set.
+ */
+
+static void convert32Scalar(uint32_t *apDst, const uint8_t *apSrc, uint32_t aCount, const Params &aParams)
+{
+    const uint32_t *src = reinterpret_cast<const uint32_t*>(apSrc);
+    uint32_t masks[4];
+    int shifts[4];
+
+    for (int i = 0 ; i < 4 ; i++) {
+        masks[i] = (aParams.shuffle[i] & 0x80) ? 0 : 0xFF;
+        shifts[i] = (aParams.shuffle[i] & 0x03) * 8;
+    }
+
+    for (uint32_t x = 0 ; x < aCount ; x++) {
+        uint32_t v = src[x];
+        apDst[x] = ((v >> shifts[0]) & masks[0])
+                | (((v >> shifts[1]) & masks[1]) << 8)
+                | (((v >> shifts[2]) & masks[2]) << 16)
+                | (((v >> shifts[3]) & masks[3]) << 24);
+    }
+}
+
+/*
+ * 16 bpp kernels, compiled for the offset and length of each channel.
+ * Channels are widened to 8 bits by replicating their top bits.
+ */
+
+template<unsigned O, unsigned L>
+static inline uint32_t expandScalar(uint32_t aValue)
+{
+    static_assert((L >= 4) && (L <= 8), "Unsupported channel length");
+    uint32_t c = (aValue >> O) & ((1u << L) - 1);
+    if constexpr (L == 8) {
+        return c;
+    } else {
+        return (c << (8 - L)) | (c >> ((2 * L) - 8));
+    }
+}
+
+template<unsigned RO, unsigned RL, unsigned GO, unsigned GL, unsigned BO, unsigned BL>
+static void convert16Scalar(uint32_t *apDst, const uint8_t *apSrc, uint32_t aCount, const Params&)
+{
+    const uint16_t *src = reinterpret_cast<const uint16_t*>(apSrc);
+
+    for (uint32_t x = 0 ; x < aCount ; x++) {
+        uint32_t v = src[x];
+        apDst[x] = expandScalar<RO, RL>(v)
+                | (expandScalar<GO, GL>(v) << 8)
+                | (expandScalar<BO, BL>(v) << 16)
+                | cOPAQUE;
+    }
+}
+
+/*
+ * 24 bpp kernels, compiled for the byte offset of each channel.
+ */
+
+template<unsigned R, unsigned G, unsigned B>
+static void convert24Scalar(uint32_t *apDst, const uint8_t *apSrc, uint32_t aCount, const Params&)
+{
+    for (uint32_t x = 0 ; x < aCount ; x++) {
+        const uint8_t *s = apSrc + (x * 3);
+        apDst[x] = s[R] | (s[G] << 8) | (uint32_t(s[B]) << 16) | cOPAQUE;
+    }
+}
+
+/*
+ * 8 bpp pseudocolor kernels, looking up the color map.
+ */
+
+static void convert8Scalar(uint32_t *apDst, const uint8_t *apSrc, uint32_t aCount, const Params &aParams)
+{
+    for (uint32_t x = 0 ; x < aCount ; x++) {
+        apDst[x] = aParams.palette[apSrc[x]];
+    }
+}
+
+/*
+ * Generic kernel for any other truecolor layout with 16, 24 or 32 bpp.
+ */
+
+static inline uint32_t scaleChannel(uint32_t aValue, const struct fb_bitfield &aField)
+{
+    if (aField.length == 0) {
+        return 0;
+    }
+    uint32_t max = (aField.length >= 32) ? 0xFFFFFFFF : ((1u << aField.length) - 1);
+    uint32_t c = (aValue >> aField.offset) & max;
+    return static_cast<uint32_t>((uint64_t(c) * 255 + (max / 2)) / max);
+}
+
+static void convertGenericScalar(uint32_t *apDst, const uint8_t *apSrc, uint32_t aCount, const Params &aParams)
+{
+    for (uint32_t x = 0 ; x < aCount ; x++) {
+        const uint8_t *s = apSrc + (x * aParams.bytesPerPixel);
+        uint32_t v = 0;
+        for (uint32_t i = 0 ; i < aParams.bytesPerPixel ; i++) {
+            v |= uint32_t(s[i]) << (i * 8);
+        }
+        apDst[x] = scaleChannel(v, aParams.red)
+                | (scaleChannel(v, aParams.green) << 8)
+                | (scaleChannel(v, aParams.blue) << 16)
+                | cOPAQUE;
+    }
+}
+
+#ifdef ROWCONVERTER_X86
+
+/**
+ * Fill a vector of byte shuffle indexes for pshufb, which works on 16 byte lanes.
+ */
+static void makeShuffleMask(uint8_t *apMask, int aBytes, const uint8_t *apShuffle)
+{
+    for (int i = 0 ; i < aBytes ; i++) {
+        uint8_t s = apShuffle[i & 3];
+        apMask[i] = (s & 0x80) ? 0x80 : static_cast<uint8_t>((i & 0x0C) + s);
+    }
+}
+
+/*
+ * SSE2 has no byte shuffle, so every output byte is isolated with
+ * a shift and a mask.
+ */
+__attribute__((target("sse2")))
+static void convert32SSE2(uint32_t *apDst, const uint8_t *apSrc, uint32_t aCount, const Params &aParams)
+{
+    const uint32_t *src = reinterpret_cast<const uint32_t*>(apSrc);
+    const uint8_t *shuffle = aParams.shuffle;
+    __m128i right[4];
+    __m128i left[4];
+    __m128i mask[4];
+
+    for (int i = 0 ; i < 4 ; i++) {
+        right[i] = _mm_cvtsi32_si128((shuffle[i] & 0x03) * 8);
+        left[i] = _mm_cvtsi32_si128(i * 8);
+        mask[i] = _mm_set1_epi32((shuffle[i] & 0x80) ? 0 : 0xFF);
+    }
+
+    uint32_t x = 0;
+    for ( ; x + 4 <= aCount ; x += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+        __m128i r = _mm_and_si128(_mm_srl_epi32(v, right[0]), mask[0]);
+        r = _mm_or_si128(r, _mm_sll_epi32(_mm_and_si128(_mm_srl_epi32(v, right[1]), mask[1]), left[1]));
+        r = _mm_or_si128(r, _mm_sll_epi32(_mm_and_si128(_mm_srl_epi32(v, right[2]), mask[2]), left[2]));
+        r = _mm_or_si128(r, _mm_sll_epi32(_mm_and_si128(_mm_srl_epi32(v, right[3]), mask[3]), left[3]));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(apDst + x), r);
+    }
+    convert32Scalar(apDst + x, apSrc + (x * 4), aCount - x, aParams);
+}
+
+__attribute__((target("avx2")))
+static void convert32AVX2(uint32_t *apDst, const uint8_t *apSrc, uint32_t aCount, const Params &aParams)
+{
+    const uint32_t *src = reinterpret_cast<const uint32_t*>(apSrc);
+    alignas(32) uint8_t bytes[32];
+    makeShuffleMask(bytes, sizeof(bytes), aParams.shuffle);
+    const __m256i shuffle = _mm256_load_si256(reinterpret_cast<const __m256i*>(bytes));
+
+    uint32_t x = 0;
+    for ( ; x + 16 <= aCount ; x += 16) {
+        __m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x));
+        __m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x + 8));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(apDst + x), _mm256_shuffle_epi8(v0, shuffle));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(apDst + x + 8), _mm256_shuffle_epi8(v1, shuffle));
+    }
+    for ( ; x + 8 <= aCount ; x += 8) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(apDst + x), _mm256_shuffle_epi8(v, shuffle));
+    }
+    convert32Scalar(apDst + x, apSrc + (x * 4), aCount - x, aParams);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void convert32AVX512(uint32_t *apDst, const uint8_t *apSrc, uint32_t aCount, const Params &aParams)
+{
+    const uint32_t *src = reinterpret_cast<const uint32_t*>(apSrc);
+    alignas(64) uint8_t bytes[64];
+    makeShuffleMask(bytes, sizeof(bytes), aParams.shuffle);
+    const __m512i shuffle = _mm512_load_si512(bytes);
+
+    uint32_t x = 0;
+    for ( ; x + 16 <= aCount ; x += 16) {
+        __m512i v = _mm512_loadu_si512(src + x);
+        _mm512_storeu_si512(apDst + x, _mm512_shuffle_epi8(v, shuffle));
+    }
+    if (x < aCount) {
+        // Masked load and store, so the tail never touches memory past the row.
+        __mmask16 m = static_cast<__mmask16>((1u << (aCount - x)) - 1);
+        __m512i v = _mm512_maskz_loadu_epi32(m, src + x);
+        _mm512_mask_storeu_epi32(apDst + x, m, _mm512_shuffle_epi8(v, shuffle));
+    }
+}
+
+template<unsigned O, unsigned L, unsigned Shift>
+__attribute__((target("sse2")))
+static inline __m128i expandSSE2(__m128i aValue)
+{
+    __m128i c = _mm_and_si128(_mm_srli_epi32(aValue, O), _mm_set1_epi32((1 << L) - 1));
+    if constexpr (L < 8) {
+        c = _mm_or_si128(_mm_slli_epi32(c, 8 - L), _mm_srli_epi32(c, (2 * L) - 8));
+    }
+    return _mm_slli_epi32(c, Shift);
+}
+
+template<unsigned RO, unsigned RL, unsigned GO, unsigned GL, unsigned BO, unsigned BL>
+__attribute__((target("sse2")))
+static inline __m128i pack16SSE2(__m128i aValue)
+{
+    return _mm_or_si128(
+        _mm_or_si128(expandSSE2<RO, RL, 0>(aValue), expandSSE2<GO, GL, 8>(aValue)),
+        _mm_or_si128(expandSSE2<BO, BL, 16>(aValue), _mm_set1_epi32(static_cast<int>(cOPAQUE))));
+}
+
+template<unsigned RO, unsigned RL, unsigned GO, unsigned GL, unsigned BO, unsigned BL>
+__attribute__((target("sse2")))
+static void convert16SSE2(uint32_t *apDst, const uint8_t *apSrc, uint32_t aCount, const Params &aParams)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    uint32_t x = 0;
+    for ( ; x + 8 <= aCount ; x += 8) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(apSrc + (x * 2)));
+        __m128i lo = _mm_unpacklo_epi16(v, zero);
+        __m128i hi = _mm_unpackhi_epi16(v, zero);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(apDst + x), pack16SSE2<RO, RL, GO, GL, BO, BL>(lo));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(apDst + x + 4), pack16SSE2<RO, RL, GO, GL, BO, BL>(hi));
+    }
+    convert16Scalar<RO, RL, GO, GL, BO, BL>(apDst + x, apSrc + (x * 2), aCount - x, aParams);
+}
+
+template<unsigned O, unsigned L, unsigned Shift>
+__attribute__((target("avx2")))
+static inline __m256i expandAVX2(__m256i aValue)
+{
+    __m256i c = _mm256_and_si256(_mm256_srli_epi32(aValue, O), _mm256_set1_epi32((1 << L) - 1));
+    if constexpr (L < 8) {
+        c = _mm256_or_si256(_mm256_slli_epi32(c, 8 - L), _mm256_srli_epi32(c, (2 * L) - 8));
+    }
+    return _mm256_slli_epi32(c, Shift);
+}
+
+template<unsigned RO, unsigned RL, unsigned GO, unsigned GL, unsigned BO, unsigned BL>
+__attribute__((target("avx2")))
+static void convert16AVX2(uint32_t *apDst, const uint8_t *apSrc, uint32_t aCount, const Params &aParams)
+{
+    const __m256i opaque = _mm256_set1_epi32(static_cast<int>(cOPAQUE));
+
+    uint32_t x = 0;
+    for ( ; x + 8 <= aCount ; x += 8) {
+        __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(apSrc + (x * 2))));
+        __m256i r = _mm256_or_si256(
+            _mm256_or_si256(expandAVX2<RO, RL, 0>(v), expandAVX2<GO, GL, 8>(v)),
+            _mm256_or_si256(expandAVX2<BO, BL, 16>(v), opaque));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(apDst + x), r);
+    }
+    convert16Scalar<RO, RL, GO, GL, BO, BL>(apDst + x, apSrc + (x * 2), aCount - x, aParams);
+}
+
+/*
+ * Each 128-bit lane takes 4 pixels from a 16 byte load, where only the
+ * first 12 bytes are used.
+ */
+template<unsigned R, unsigned G, unsigned B>
+__attribute__((target("avx2")))
+static void convert24AVX2(uint32_t *apDst, const uint8_t *apSrc, uint32_t aCount, const Params &aParams)
+{
+    alignas(32) uint8_t bytes[32];
+    for (int i = 0 ; i < 32 ; i++) {
+        const unsigned channel[4] = { R, G, B, 0 };
+        int p = (i & 0x0F) / 4;
+        bytes[i] = ((i & 3) == 3) ? 0x80 : static_cast<uint8_t>((p * 3) + channel[i & 3]);
+    }
+    const __m256i shuffle = _mm256_load_si256(reinterpret_cast<const __m256i*>(bytes));
+    const __m256i opaque = _mm256_set1_epi32(static_cast<int>(cOPAQUE));
+
+    // The second load reads 4 bytes past the 8 pixels, so stop 2 pixels early
+    uint32_t x = 0;
+    for ( ; x + 10 <= aCount ; x += 8) {
+        const uint8_t *s = apSrc + (x * 3);
+        __m256i v = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s))),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 12)), 1);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(apDst + x), _mm256_or_si256(_mm256_shuffle_epi8(v, shuffle), opaque));
+    }
+    convert24Scalar<R, G, B>(apDst + x, apSrc + (x * 3), aCount - x, aParams);
+}
+
+__attribute__((target("avx2")))
+static void convert8AVX2(uint32_t *apDst, const uint8_t *apSrc, uint32_t aCount, const Params &aParams)
+{
+    const int *palette = reinterpret_cast<const int*>(aParams.palette);
+
+    uint32_t x = 0;
+    for ( ; x + 8 <= aCount ; x += 8) {
+        __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(apSrc + x)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(apDst + x), _mm256_i32gather_epi32(palette, index, 4));
+    }
+    convert8Scalar(apDst + x, apSrc + x, aCount - x, aParams);
+}
+
+    #define KERNELS16(RO, RL, GO, GL, BO, BL) { convert16Scalar<RO, RL, GO, GL, BO, BL>, \
+        convert16SSE2<RO, RL, GO, GL, BO, BL>, convert16AVX2<RO, RL, GO, GL, BO, BL>, nullptr }
+    #define KERNELS24(R, G, B) { convert24Scalar<R, G, B>, nullptr, convert24AVX2<R, G, B>, nullptr }
+    #define KERNELS8 { convert8Scalar, nullptr, convert8AVX2, nullptr }
+    #define KERNELS32 { convert32Scalar, convert32SSE2, convert32AVX2, convert32AVX512 }
+#else
+    #define KERNELS16(RO, RL, GO, GL, BO, BL) { convert16Scalar<RO, RL, GO, GL, BO, BL>, nullptr, nullptr, nullptr }
+    #define KERNELS24(R, G, B) { convert24Scalar<R, G, B>, nullptr, nullptr, nullptr }
+    #define KERNELS8 { convert8Scalar, nullptr, nullptr, nullptr }
+    #define KERNELS32 { convert32Scalar, nullptr, nullptr, nullptr }
+#endif /* ROWCONVERTER_X86 */
+
+/**
+ * Specialized kernels, indexed by Isa. A missing kernel falls back to the
+ * kernel for a lower instruction set.
+ */
+struct KernelSet {
+    const char *name;
+    uint32_t bpp;
+    uint32_t redOffset, redLength;
+    uint32_t greenOffset, greenLength;
+    uint32_t blueOffset, blueLength;
+    RowConverter::RowKernel kernels[4];
+};
+
+static const KernelSet cKERNEL_SETS[] = {
+    // Layouts produced by vfb_check_var()
+    { "rgb565",   16,  0, 5,  5, 6, 11, 5, KERNELS16(0, 5, 5, 6, 11, 5) },
+    { "rgba5551", 16,  0, 5,  5, 5, 10, 5, KERNELS16(0, 5, 5, 5, 10, 5) },
+    { "rgb888",   24,  0, 8,  8, 8, 16, 8, KERNELS24(0, 1, 2) },
+    // Common layouts of real hardware
+    { "bgr565",   16, 11, 5,  5, 6,  0, 5, KERNELS16(11, 5, 5, 6, 0, 5) },
+    { "bgra5551", 16, 10, 5,  5, 5,  0, 5, KERNELS16(10, 5, 5, 5, 0, 5) },
+    { "bgr888",   24, 16, 8,  8, 8,  0, 8, KERNELS24(2, 1, 0) },
+};
+
+static const KernelSet cKERNEL_SET_8 = { "cmap8", 8, 0, 0, 0, 0, 0, 0, KERNELS8 };
+static const KernelSet cKERNEL_SET_32 = { "shuffle32", 32, 0, 0, 0, 0, 0, 0, KERNELS32 };
+
+static const char* cISA_NAMES[] = { "scalar", "sse2", "avx2", "avx512" };
+
+RowConverter::Isa RowConverter::GetIsa()
+{
+    static const Isa isa = []() {
+#ifdef ROWCONVERTER_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+            return Isa::AVX512;
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            return Isa::AVX2;
+        }
+        if (__builtin_cpu_supports("sse2")) {
+            return Isa::SSE2;
+        }
+#endif
+        return Isa::Scalar;
+    }();
+
+    return isa;
+}
+
+RowConverter::RowConverter()
+{
+}
+
+static bool isByteChannel(const struct fb_bitfield &aField)
+{
+    return (aField.length == 8) && ((aField.offset % 8) == 0) && (aField.offset < 32) && !aField.msb_right;
+}
+
+void RowConverter::Configure(const struct fb_var_screeninfo &aVar)
+{
+    const KernelSet *set = nullptr;
+
+    mBitsPerPixel = aVar.bits_per_pixel;
+    mIdentity = false;
+    mParams.bytesPerPixel = aVar.bits_per_pixel / 8;
+    mParams.red = aVar.red;
+    mParams.green = aVar.green;
+    mParams.blue = aVar.blue;
+
+    switch (aVar.bits_per_pixel) {
+        case 8:
+            set = &cKERNEL_SET_8;
+            break;
+
+        case 16:
+        case 24:
+            for (const KernelSet &s : cKERNEL_SETS) {
+                if ((s.bpp == aVar.bits_per_pixel)
+                    && (s.redOffset == aVar.red.offset) && (s.redLength == aVar.red.length)
+                    && (s.greenOffset == aVar.green.offset) && (s.greenLength == aVar.green.length)
+                    && (s.blueOffset == aVar.blue.offset) && (s.blueLength == aVar.blue.length)
+                    && !aVar.red.msb_right && !aVar.green.msb_right && !aVar.blue.msb_right) {
+                    set = &s;
+                    break;
+                }
+            }
+            break;
+
+        case 32:
+            if (isByteChannel(aVar.red) && isByteChannel(aVar.green) && isByteChannel(aVar.blue)) {
+                const struct fb_bitfield *channels[4] = { &aVar.red, &aVar.green, &aVar.blue, &aVar.transp };
+                for (int i = 0 ; i < 4 ; i++) {
+                    mParams.shuffle[i] = isByteChannel(*channels[i]) ? static_cast<uint8_t>(channels[i]->offset / 8) : 0x80;
+                }
+                set = &cKERNEL_SET_32;
+
+                // The X byte of the output is ignored, so the alpha channel does not
+                // prevent plain copies.
+                mIdentity = (mParams.shuffle[0] == 0) && (mParams.shuffle[1] == 1) && (mParams.shuffle[2] == 2);
+            }
+            break;
+
+        default:
+            throw std::runtime_error("Frame buffer reports unsupported color depth.");
+    }
+
+    if (mIdentity) {
+        mpKernel = nullptr;
+        mKernelName = "memcpy";
+    } else if (set) {
+        int isa = static_cast<int>(GetIsa());
+        while (!set->kernels[isa]) {
+            isa--;
+        }
+        mpKernel = set->kernels[isa];
+        mKernelName = std::string(set->name) + "/" + cISA_NAMES[isa];
+    } else {
+        if ((aVar.red.length > 16) || (aVar.green.length > 16) || (aVar.blue.length > 16)
+            || aVar.red.msb_right || aVar.green.msb_right || aVar.blue.msb_right) {
+            throw std::runtime_error("Frame buffer reports unsupported pixel layout.");
+        }
+        mpKernel = convertGenericScalar;
+        mKernelName = "generic/scalar";
+    }
+
+    LOG("Row kernel: ", mKernelName);
+}
+
+bool RowConverter::SetPalette(const struct fb_cmap &aCmap)
+{
+    bool changed = false;
+
+    for (uint32_t i = 0 ; (i < aCmap.len) && ((aCmap.start + i) < 256) ; i++) {
+        uint32_t color = (aCmap.red[i] >> 8)
+            | ((aCmap.green[i] >> 8) << 8)
+            | (uint32_t(aCmap.blue[i] >> 8) << 16)
+            | cOPAQUE;
+        uint32_t &entry = mParams.palette[aCmap.start + i];
+        if (entry != color) {
+            entry = color;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+void RowConverter::Convert(void *apDst, int aDstPitch, const void *apSrc, int aSrcPitch, uint32_t aWidth, uint32_t aHeight) const
+{
+    uint8_t *dst = static_cast<uint8_t*>(apDst);
+    const uint8_t *src = static_cast<const uint8_t*>(apSrc);
+    size_t row_bytes = size_t(aWidth) * sizeof(uint32_t);
+
+    if (mIdentity) {
+        if ((size_t(aDstPitch) == row_bytes) && (size_t(aSrcPitch) == row_bytes)) {
+            std::memcpy(dst, src, row_bytes * aHeight);
+            return;
+        }
+        for (uint32_t y = 0 ; y < aHeight ; y++) {
+            std::memcpy(dst, src, row_bytes);
+            dst += aDstPitch;
+            src += aSrcPitch;
+        }
+        return;
+    }
+
+    for (uint32_t y = 0 ; y < aHeight ; y++) {
+        mpKernel(reinterpret_cast<uint32_t*>(dst), src, aWidth, mParams);
+        dst += aDstPitch;
+        src += aSrcPitch;
+    }
+}
@@ -0,0 +1,137 @@
+/*
+ * RowConverter.h
+ *
+ * Copyright (C) 2021 RSP Systems <software@rspsystems.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef ROWCONVERTER_H_
+#define ROWCONVERTER_H_
+
+#include <cstdint>
+#include <string>
+#include <linux/fb.h>
+
+/**
+ * \class RowConverter
+ * \brief Copies rectangles of frame buffer pixels into 32-bit output pixels
+ *        with R, G, B, X byte order (SDL_PIXELFORMAT_XBGR8888).
+ *
+ *        The conversion is done one row at a time, by a kernel selected
+ *        when the mode is set, from the pixel layout of the frame buffer and
+ *        the instruction sets reported by the CPU. Kernels for the layouts
+ *        produced by vfb2 are compiled for their bitfields, other layouts
+ *        use a generic kernel. Rows that already have the output layout
+ *        are copied with memcpy.
+ */
+class RowConverter
+{
+public:
+    /**
+     * \enum Isa
+     * \brief Instruction set used by the row kernels.
+     */
+    enum class Isa {
+        Scalar,
+        SSE2,
+        AVX2,
+        AVX512
+    };
+
+    /**
+     * \struct Params
+     * \brief Layout dependent values used by the row kernels.
+     */
+    struct Params {
+        /** 32 bpp: Output byte i is taken from source byte shuffle[i], 0x80 clears it */
+        uint8_t shuffle[4] = { 0, 1, 2, 3 };
+        /** 8 bpp: Color map as output pixels */
+        uint32_t palette[256] = {};
+        /** Generic kernel: Source layout */
+        uint32_t bytesPerPixel = 4;
+        struct fb_bitfield red = {};
+        struct fb_bitfield green = {};
+        struct fb_bitfield blue = {};
+    };
+
+    typedef void (*RowKernel)(uint32_t *apDst, const uint8_t *apSrc, uint32_t aCount, const Params &aParams);
+
+    RowConverter();
+
+    /**
+     * \fn void Configure(const struct fb_var_screeninfo&)
+     * \brief Select the row kernel matching the pixel layout of the frame buffer.
+     *        Throws if the layout cannot be converted.
+     *
+     * \param aVar Variable screen info of the frame buffer
+     */
+    void Configure(const struct fb_var_screeninfo &aVar);
+
+    /**
+     * \fn bool SetPalette(const struct fb_cmap&)
+     * \brief Update the color map used for 8 bpp pseudocolor modes.
+     *
+     * \param aCmap Color map read with FBIOGETCMAP
+     * \return true if any color changed
+     */
+    bool SetPalette(const struct fb_cmap &aCmap);
+
+    /**
+     * \fn void Convert(void*, int, const void*, int, uint32_t, uint32_t)
+     * \brief Convert a rectangle of pixels.
+     *
+     * \param apDst Address of the first output pixel
+     * \param aDstPitch Bytes between output rows
+     * \param apSrc Address of the first frame buffer pixel
+     * \param aSrcPitch Bytes between frame buffer rows, e.g. line_length
+     * \param aWidth in pixels
+     * \param aHeight in pixels
+     */
+    void Convert(void *apDst, int aDstPitch, const void *apSrc, int aSrcPitch, uint32_t aWidth, uint32_t aHeight) const;
+
+    /**
+     * \fn bool IsIdentity()
+     * \brief Check if frame buffer rows can be used without conversion.
+     *
+     * \return true if rows are plain copies
+     */
+    bool IsIdentity() const { return mIdentity; }
+
+    /**
+     * \fn bool UsesPalette()
+     * \brief Check if the frame buffer is in a pseudocolor mode.
+     */
+    bool UsesPalette() const { return mBitsPerPixel == 8; }
+
+    /**
+     * \fn const char* GetKernelName()
+     * \brief Name of the selected row kernel, for logging.
+     */
+    const char* GetKernelName() const { return mKernelName.c_str(); }
+
+    /**
+     * \fn Isa GetIsa()
+     * \brief The best instruction set supported by this CPU, detected once at startup.
+     */
+    static Isa GetIsa();
+
+protected:
+    RowKernel mpKernel = nullptr;
+    std::string mKernelName;
+    bool mIdentity = true;
+    uint32_t mBitsPerPixel = 32;
+    Params mParams;
+};
+
+#endif /* ROWCONVERTER_H_ */
@@ -0,0 +1,344 @@
+/*
+ * Scaler.cpp
+ *
+ * Copyright (C) 2021 RSP Systems <software@rspsystems.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include "Scaler.h"
+#include "RowConverter.h"
+#include "log.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #define SCALER_X86
+    #include <immintrin.h>
+#endif
+
+/*
+ * Bilinear weights have 7 bits, so the product of a channel difference and
+ * a weight fits in a signed 16-bit lane. Each channel is computed as
+ * a + (((b - a) * w) >> 7), with an arithmetic shift, in every kernel, so
+ * scalar and vector kernels give identical results.
+ */
+static const int cWEIGHT_BITS = 7;
+static const int cWEIGHT_ONE = 1 << cWEIGHT_BITS;
+
+typedef void (*NearestRowFunc)(uint32_t *apDst, const uint32_t *apSrc, const int32_t *apIndex, uint32_t aCount);
+typedef void (*BlendRowFunc)(uint32_t *apDst, const uint32_t *apA, const uint32_t *apB, uint32_t aWeight, uint32_t aCount);
+typedef void (*BilinearRowFunc)(uint32_t *apDst, const uint32_t *apSrc, const int32_t *apIndex, const uint16_t *apWeight,
+    int32_t aBase, uint32_t aCount);
+
+static inline uint32_t blendPixel(uint32_t aA, uint32_t aB, uint32_t aWeight)
+{
+    uint32_t result = 0;
+    for (int shift = 0 ; shift < 32 ; shift += 8) {
+        int a = (aA >> shift) & 0xFF;
+        int b = (aB >> shift) & 0xFF;
+        result |= uint32_t(a + (((b - a) * int(aWeight)) >> cWEIGHT_BITS)) << shift;
+    }
+    return result;
+}
+
+static void nearestRowScalar(uint32_t *apDst, const uint32_t *apSrc, const int32_t *apIndex, uint32_t aCount)
+{
+    for (uint32_t x = 0 ; x < aCount ; x++) {
+        apDst[x] = apSrc[apIndex[x]];
+    }
+}
+
+static void blendRowScalar(uint32_t *apDst, const uint32_t *apA, const uint32_t *apB, uint32_t aWeight, uint32_t aCount)
+{
+    for (uint32_t x = 0 ; x < aCount ; x++) {
+        apDst[x] = blendPixel(apA[x], apB[x], aWeight);
+    }
+}
+
+static void bilinearRowScalar(uint32_t *apDst, const uint32_t *apSrc, const int32_t *apIndex, const uint16_t *apWeight,
+    int32_t aBase, uint32_t aCount)
+{
+    for (uint32_t x = 0 ; x < aCount ; x++) {
+        const uint32_t *p = apSrc + (apIndex[x] - aBase);
+        apDst[x] = blendPixel(p[0], p[1], apWeight[x]);
+    }
+}
+
+#ifdef SCALER_X86
+__attribute__((target("sse2")))
+static inline __m128i blend16SSE2(__m128i aA, __m128i aB, __m128i aWeight)
+{
+    return _mm_add_epi16(aA, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(aB, aA), aWeight), cWEIGHT_BITS));
+}
+
+__attribute__((target("sse2")))
+static void blendRowSSE2(uint32_t *apDst, const uint32_t *apA, const uint32_t *apB, uint32_t aWeight, uint32_t aCount)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i weight = _mm_set1_epi16(int16_t(aWeight));
+    uint32_t x = 0;
+
+    for ( ; x + 4 <= aCount ; x += 4) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(apA + x));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(apB + x));
+        __m128i lo = blend16SSE2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), weight);
+        __m128i hi = blend16SSE2(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), weight);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(apDst + x), _mm_packus_epi16(lo, hi));
+    }
+    blendRowScalar(apDst + x, apA + x, apB + x, aWeight, aCount - x);
+}
+
+__attribute__((target("sse2")))
+static void bilinearRowSSE2(uint32_t *apDst, const uint32_t *apSrc, const int32_t *apIndex, const uint16_t *apWeight,
+    int32_t aBase, uint32_t aCount)
+{
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t x = 0;
+
+    // Two output pixels at a time, each from a pair of neighbouring pixels
+    for ( ; x + 2 <= aCount ; x += 2) {
+        __m128i p = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(apSrc + (apIndex[x] - aBase)));
+        __m128i q = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(apSrc + (apIndex[x + 1] - aBase)));
+        // p0 q0 p1 q1
+        __m128i pairs = _mm_shuffle_epi32(_mm_unpacklo_epi64(p, q), _MM_SHUFFLE(3, 1, 2, 0));
+        __m128i weight = _mm_unpacklo_epi64(_mm_set1_epi16(int16_t(apWeight[x])), _mm_set1_epi16(int16_t(apWeight[x + 1])));
+        __m128i result = blend16SSE2(_mm_unpacklo_epi8(pairs, zero), _mm_unpackhi_epi8(pairs, zero), weight);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(apDst + x), _mm_packus_epi16(result, result));
+    }
+    bilinearRowScalar(apDst + x, apSrc, apIndex + x, apWeight + x, aBase, aCount - x);
+}
+
+__attribute__((target("avx2")))
+static void nearestRowAVX2(uint32_t *apDst, const uint32_t *apSrc, const int32_t *apIndex, uint32_t aCount)
+{
+    uint32_t x = 0;
+
+    for ( ; x + 8 <= aCount ; x += 8) {
+        __m256i index = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(apIndex + x));
+        __m256i pixels = _mm256_i32gather_epi32(reinterpret_cast<const int*>(apSrc), index, 4);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(apDst + x), pixels);
+    }
+    nearestRowScalar(apDst + x, apSrc, apIndex + x, aCount - x);
+}
+
+__attribute__((target("avx2")))
+static void blendRowAVX2(uint32_t *apDst, const uint32_t *apA, const uint32_t *apB, uint32_t aWeight, uint32_t aCount)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i weight = _mm256_set1_epi16(int16_t(aWeight));
+    uint32_t x = 0;
+
+    // Unpack and pack both work within 128-bit lanes, so the order is kept
+    for ( ; x + 8 <= aCount ; x += 8) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(apA + x));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(apB + x));
+        __m256i alo = _mm256_unpacklo_epi8(a, zero);
+        __m256i ahi = _mm256_unpackhi_epi8(a, zero);
+        __m256i lo = _mm256_add_epi16(alo, _mm256_srai_epi16(
+            _mm256_mullo_epi16(_mm256_sub_epi16(_mm256_unpacklo_epi8(b, zero), alo), weight), cWEIGHT_BITS));
+        __m256i hi = _mm256_add_epi16(ahi, _mm256_srai_epi16(
+            _mm256_mullo_epi16(_mm256_sub_epi16(_mm256_unpackhi_epi8(b, zero), ahi), weight), cWEIGHT_BITS));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(apDst + x), _mm256_packus_epi16(lo, hi));
+    }
+    blendRowSSE2(apDst + x, apA + x, apB + x, aWeight, aCount - x);
+}
+#endif
+
+struct ScaleKernels {
+    NearestRowFunc nearest;
+    BlendRowFunc blend;
+    BilinearRowFunc bilinear;
+    const char *name;
+};
+
+static const ScaleKernels& selectKernels()
+{
+    static const ScaleKernels scalar = { nearestRowScalar, blendRowScalar, bilinearRowScalar, "scalar" };
+#ifdef SCALER_X86
+    static const ScaleKernels sse2 = { nearestRowScalar, blendRowSSE2, bilinearRowSSE2, "sse2" };
+    static const ScaleKernels avx2 = { nearestRowAVX2, blendRowAVX2, bilinearRowSSE2, "avx2" };
+
+    if (RowConverter::GetIsa() >= RowConverter::Isa::AVX2) {
+        return avx2;
+    }
+    if (RowConverter::GetIsa() >= RowConverter::Isa::SSE2) {
+        return sse2;
+    }
+#endif
+    return scalar;
+}
+
+Scaler::Scaler()
+{
+}
+
+Scaler::Filter Scaler::ParseFilter(const std::string &arName)
+{
+    if (arName == "none") {
+        return Filter::None;
+    }
+    if (arName == "nearest") {
+        return Filter::Nearest;
+    }
+    if (arName == "bilinear") {
+        return Filter::Bilinear;
+    }
+    throw std::invalid_argument("Unknown scaling filter: " + arName);
+}
+
+void Scaler::Configure(Filter aFilter, uint32_t aSrcWidth, uint32_t aSrcHeight, uint32_t aDstWidth, uint32_t aDstHeight)
+{
+    mFilter = aFilter;
+    mSrcWidth = std::max(aSrcWidth, 1u);
+    mSrcHeight = std::max(aSrcHeight, 1u);
+
+    double scale = std::min(double(aDstWidth) / mSrcWidth, double(aDstHeight) / mSrcHeight);
+    if (mFilter == Filter::None) {
+        scale = 1.0;
+    } else if ((mFilter == Filter::Nearest) && (scale >= 1.0)) {
+        // Whole pixels keep pixel art and text sharp
+        scale = std::floor(scale);
+    }
+    mWidth = std::max(uint32_t(std::lround(mSrcWidth * scale)), 1u);
+    mHeight = std::max(uint32_t(std::lround(mSrcHeight * scale)), 1u);
+    mX = (aDstWidth > mWidth) ? (aDstWidth - mWidth) / 2 : 0;
+    mY = (aDstHeight > mHeight) ? (aDstHeight - mHeight) / 2 : 0;
+
+    auto positions = [this](uint32_t aSrc, uint32_t aDst, std::vector<int32_t> &arIndex, std::vector<uint16_t> &arWeight) {
+        arIndex.resize(aDst);
+        arWeight.assign(aDst, 0);
+        for (uint32_t d = 0 ; d < aDst ; d++) {
+            if (mFilter != Filter::Bilinear) {
+                arIndex[d] = int32_t((uint64_t(d) * aSrc) / aDst);
+                continue;
+            }
+            // Pixel centers of the output, in source coordinates
+            double pos = std::max(((d + 0.5) * aSrc / aDst) - 0.5, 0.0);
+            int32_t index = int32_t(pos);
+            int weight = int(std::lround((pos - index) * cWEIGHT_ONE));
+            if (weight == cWEIGHT_ONE) {
+                index++;
+                weight = 0;
+            }
+            if (index >= int32_t(aSrc) - 1) {
+                index = aSrc - 1;
+                weight = 0;
+            }
+            arIndex[d] = index;
+            arWeight[d] = uint16_t(weight);
+        }
+    };
+    positions(mSrcWidth, mWidth, mXIndex, mXWeight);
+    positions(mSrcHeight, mHeight, mYIndex, mYWeight);
+
+    const char *filters[] = { "none", "nearest", "bilinear" };
+    mKernelName = std::string(filters[int(mFilter)]) + "/" + selectKernels().name;
+    LOG("Scaler: ", mKernelName, " ", mSrcWidth, "x", mSrcHeight, " to ", mWidth, "x", mHeight, " at ", mX, ",", mY);
+}
+
+Damage::Rect Scaler::MapRect(const Damage::Rect &arRect) const
+{
+    if (!IsEnabled()) {
+        return arRect;
+    }
+
+    // An output pixel reads source pixels index and, for bilinear, index + 1
+    int32_t reach = (mFilter == Filter::Bilinear) ? 1 : 0;
+    auto map = [reach](const std::vector<int32_t> &arIndex, uint32_t aStart, uint32_t aLength, uint32_t &arOutStart, uint32_t &arOutLength) {
+        auto first = std::lower_bound(arIndex.begin(), arIndex.end(), int32_t(aStart) - reach);
+        auto last = std::upper_bound(first, arIndex.end(), int32_t(aStart + aLength) - 1);
+        arOutStart = uint32_t(first - arIndex.begin());
+        arOutLength = uint32_t(last - first);
+    };
+
+    Damage::Rect result;
+    map(mXIndex, arRect.x, arRect.w, result.x, result.w);
+    map(mYIndex, arRect.y, arRect.h, result.y, result.h);
+    return result;
+}
+
+void Scaler::Scale(uint32_t *apDst, int aDstPitch, const uint8_t *apSrc, const uint8_t *apWrapped, uint32_t aWrapRow,
+    int aSrcPitch, const Damage::Rect &arRect)
+{
+    if (!arRect.w || !arRect.h) {
+        return;
+    }
+    mpSrc = apSrc;
+    mpWrapped = apWrapped;
+    mWrapRow = aWrapRow;
+    mSrcPitch = aSrcPitch;
+    if (mFilter == Filter::Bilinear) {
+        ScaleBilinear(apDst, aDstPitch, arRect);
+    } else {
+        ScaleNearest(apDst, aDstPitch, arRect);
+    }
+}
+
+const uint32_t* Scaler::GetSrcRow(int32_t aY) const
+{
+    uint32_t y = uint32_t(aY);
+    const uint8_t *row = (y < mWrapRow) ? mpSrc + (size_t(y) * mSrcPitch) : mpWrapped + (size_t(y - mWrapRow) * mSrcPitch);
+    return reinterpret_cast<const uint32_t*>(row);
+}
+
+void Scaler::ScaleNearest(uint32_t *apDst, int aDstPitch, const Damage::Rect &arRect)
+{
+    static const ScaleKernels &kernels = selectKernels();
+    const int32_t *index = mXIndex.data() + arRect.x;
+    uint8_t *dst = reinterpret_cast<uint8_t*>(apDst);
+
+    for (uint32_t y = 0 ; y < arRect.h ; y++, dst += aDstPitch) {
+        int32_t sy = mYIndex[arRect.y + y];
+        if (y && (sy == mYIndex[arRect.y + y - 1])) {
+            // Rows repeated by upscaling are copied
+            std::memcpy(dst, dst - aDstPitch, arRect.w * sizeof(uint32_t));
+            continue;
+        }
+        kernels.nearest(reinterpret_cast<uint32_t*>(dst), GetSrcRow(sy), index, arRect.w);
+    }
+}
+
+void Scaler::ScaleBilinear(uint32_t *apDst, int aDstPitch, const Damage::Rect &arRect)
+{
+    static const ScaleKernels &kernels = selectKernels();
+    const int32_t *index = mXIndex.data() + arRect.x;
+    const uint16_t *weight = mXWeight.data() + arRect.x;
+    uint8_t *dst = reinterpret_cast<uint8_t*>(apDst);
+
+    // Source columns used by the output columns, plus a copy of the last
+    // column, so index + 1 is always readable
+    int32_t c0 = index[0];
+    int32_t c1 = std::min<int32_t>(index[arRect.w - 1] + 1, mSrcWidth - 1);
+    uint32_t columns = uint32_t(c1 - c0 + 1);
+    mRow.resize(columns + 1);
+
+    for (uint32_t y = 0 ; y < arRect.h ; y++, dst += aDstPitch) {
+        uint32_t dy = arRect.y + y;
+        int32_t sy = mYIndex[dy];
+        if (y && (sy == mYIndex[dy - 1]) && (mYWeight[dy] == mYWeight[dy - 1])) {
+            std::memcpy(dst, dst - aDstPitch, arRect.w * sizeof(uint32_t));
+            continue;
+        }
+        int32_t sy1 = std::min<int32_t>(sy + 1, mSrcHeight - 1);
+        const uint32_t *a = GetSrcRow(sy) + c0;
+        const uint32_t *b = GetSrcRow(sy1) + c0;
+
+        kernels.blend(mRow.data(), a, b, mYWeight[dy], columns);
+        mRow[columns] = mRow[columns - 1];
+        kernels.bilinear(reinterpret_cast<uint32_t*>(dst), mRow.data(), index, weight, c0, arRect.w);
+    }
+}
@@ -0,0 +1,141 @@
+/*
+ * Scaler.h
+ *
+ * Copyright (C) 2021 RSP Systems <software@rspsystems.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef SCALER_H_
+#define SCALER_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "Damage.h"
+
+/**
+ * \class Scaler
+ * \brief Scales 32-bit pixels from the frame size to the window size on the
+ *        CPU, one damaged rectangle at a time, so hosts without a GPU do not
+ *        depend on the software renderer to scale.
+ *
+ *        The frame keeps its aspect ratio, and is centered in the output.
+ *        Nearest neighbour scaling uses the largest integer factor that
+ *        fits, bilinear scaling fills the output. The row kernels are
+ *        selected from the instruction sets reported by the CPU.
+ */
+class Scaler
+{
+public:
+    /**
+     * \enum Filter
+     * \brief How output pixels are sampled from the frame.
+     */
+    enum class Filter {
+        None,
+        Nearest,
+        Bilinear
+    };
+
+    Scaler();
+
+    /**
+     * \fn Filter ParseFilter(const std::string&)
+     * \brief Filter from its command line name, "none", "nearest" or "bilinear".
+     *        Throws if the name is unknown.
+     */
+    static Filter ParseFilter(const std::string &arName);
+
+    /**
+     * \fn void Configure(Filter, uint32_t, uint32_t, uint32_t, uint32_t)
+     * \brief Set up the sampling positions for a frame and output size.
+     *
+     * \param aFilter
+     * \param aSrcWidth Frame width in pixels
+     * \param aSrcHeight Frame height in pixels
+     * \param aDstWidth Output width in pixels
+     * \param aDstHeight Output height in pixels
+     */
+    void Configure(Filter aFilter, uint32_t aSrcWidth, uint32_t aSrcHeight, uint32_t aDstWidth, uint32_t aDstHeight);
+
+    /**
+     * \fn Damage::Rect MapRect(const Damage::Rect&)
+     * \brief The area of the scaled frame that depends on an area of the frame.
+     *
+     * \param arRect in frame coordinates
+     * \return The area in scaled frame coordinates, possibly empty
+     */
+    Damage::Rect MapRect(const Damage::Rect &arRect) const;
+
+    /**
+     * \fn void Scale(uint32_t*, int, const uint8_t*, const uint8_t*, uint32_t, int, const Damage::Rect&)
+     * \brief Compute an area of the scaled frame. The frame must be valid one
+     *        pixel around the frame area the scaled area was mapped from.
+     *
+     * \param apDst Address of the first pixel of arRect in the scaled frame
+     * \param aDstPitch Bytes between output rows
+     * \param apSrc Address of the first pixel of the frame
+     * \param apWrapped Address of frame row aWrapRow, for a frame wrapping around the end of video memory
+     * \param aWrapRow First frame row read from apWrapped, at least the frame height if it does not wrap
+     * \param aSrcPitch Bytes between frame rows
+     * \param arRect in scaled frame coordinates
+     */
+    void Scale(uint32_t *apDst, int aDstPitch, const uint8_t *apSrc, const uint8_t *apWrapped, uint32_t aWrapRow,
+        int aSrcPitch, const Damage::Rect &arRect);
+
+    bool IsEnabled() const { return mFilter != Filter::None; }
+    /** Size of the scaled frame */
+    uint32_t GetWidth() const { return mWidth; }
+    uint32_t GetHeight() const { return mHeight; }
+    /** Position of the scaled frame in the output */
+    uint32_t GetX() const { return mX; }
+    uint32_t GetY() const { return mY; }
+
+    /**
+     * \fn const char* GetKernelName()
+     * \brief Name of the selected kernels, for logging.
+     */
+    const char* GetKernelName() const { return mKernelName.c_str(); }
+
+protected:
+    Filter mFilter = Filter::None;
+    uint32_t mSrcWidth = 0;
+    uint32_t mSrcHeight = 0;
+    uint32_t mWidth = 0;
+    uint32_t mHeight = 0;
+    uint32_t mX = 0;
+    uint32_t mY = 0;
+    std::string mKernelName;
+
+    /** Source column and row of each output column and row */
+    std::vector<int32_t> mXIndex;
+    std::vector<int32_t> mYIndex;
+    /** Bilinear: Weight of the next column and row, 0 to 127 */
+    std::vector<uint16_t> mXWeight;
+    std::vector<uint16_t> mYWeight;
+    /** Bilinear: Source rows blended vertically */
+    std::vector<uint32_t> mRow;
+
+    /** Frame rows of the current Scale() call */
+    const uint8_t *mpSrc = nullptr;
+    const uint8_t *mpWrapped = nullptr;
+    uint32_t mWrapRow = 0;
+    int mSrcPitch = 0;
+
+    const uint32_t* GetSrcRow(int32_t aY) const;
+    void ScaleNearest(uint32_t *apDst, int aDstPitch, const Damage::Rect &arRect);
+    void ScaleBilinear(uint32_t *apDst, int aDstPitch, const Damage::Rect &arRect);
+};
+
+#endif /* SCALER_H_ */
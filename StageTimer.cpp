@@ -0,0 +1,53 @@
+/*
+ * StageTimer.cpp
+ *
+ * Copyright (C) 2021 RSP Systems <software@rspsystems.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <iomanip>
+#include "StageTimer.h"
+
+StageTimer::StageTimer(const char *apName)
+    : mName(apName)
+{
+}
+
+void StageTimer::Add(Clock::duration aDuration)
+{
+    // A start taken elsewhere, e.g. by the driver, can be later than the end
+    uint64_t ns = std::max<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(aDuration).count(), 0);
+    mCount++;
+    mTotalNanoSeconds += ns;
+    mMaxNanoSeconds = std::max(mMaxNanoSeconds, ns);
+}
+
+StageTimer::Clock::time_point StageTimer::Add(Clock::time_point aStart)
+{
+    Clock::time_point now = Clock::now();
+    Add(now - aStart);
+    return now;
+}
+
+void StageTimer::Print(std::ostream &aStream) const
+{
+    double avg_ms = mCount ? (mTotalNanoSeconds / 1e6 / mCount) : 0.0;
+
+    aStream << std::left << std::setw(10) << (mName + ":") << std::right
+            << std::setw(8) << mCount << " times, avg "
+            << std::fixed << std::setprecision(3) << avg_ms << " ms, max "
+            << (mMaxNanoSeconds / 1e6) << " ms" << std::defaultfloat << std::endl;
+}
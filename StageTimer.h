@@ -0,0 +1,66 @@
+/*
+ * StageTimer.h
+ *
+ * Copyright (C) 2021 RSP Systems <software@rspsystems.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef STAGETIMER_H_
+#define STAGETIMER_H_
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+/**
+ * \class StageTimer
+ * \brief Accumulates the time spent in one stage of the render pipeline.
+ *        Each timer is only updated from a single thread.
+ */
+class StageTimer
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    explicit StageTimer(const char *apName);
+
+    /**
+     * \fn void Add(Clock::duration)
+     * \brief Account for one pass through the stage.
+     */
+    void Add(Clock::duration aDuration);
+
+    /**
+     * \fn Clock::time_point Add(Clock::time_point)
+     * \brief Account for a pass through the stage that started at aStart, and ended now.
+     *
+     * \return The current time, i.e. the start of the next stage
+     */
+    Clock::time_point Add(Clock::time_point aStart);
+
+    /**
+     * \fn void Print(std::ostream&)
+     * \brief Print count, average and maximum duration.
+     */
+    void Print(std::ostream &aStream) const;
+
+protected:
+    std::string mName;
+    uint64_t mCount = 0;
+    uint64_t mTotalNanoSeconds = 0;
+    uint64_t mMaxNanoSeconds = 0;
+};
+
+#endif /* STAGETIMER_H_ */
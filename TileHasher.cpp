@@ -0,0 +1,213 @@
+/*
+ * TileHasher.cpp
+ *
+ * Copyright (C) 2021 RSP Systems <software@rspsystems.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include "TileHasher.h"
+#include "RowConverter.h"
+#include "log.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #define TILEHASHER_X86
+    #include <immintrin.h>
+#endif
+
+/*
+ * The hash consumes 32 byte chunks in four 64-bit lanes, in the style of
+ * xxh3: each lane accumulates the data plus the product of the two halves
+ * of the data xor'ed with a key. The key advances for every chunk, which
+ * makes the hash depend on the position of the data within the tile.
+ * Scalar and vector kernels give identical results.
+ */
+static const uint64_t cKEYS[4] = {
+    0xbe4ba423396cfeb8ull, 0x1cad21f72c81017cull, 0xdb979083e96dd4deull, 0x1f67b3b7a4a44072ull
+};
+static const uint64_t cKEY_STEP = 0x9e3779b97f4a7c15ull;
+
+typedef void (*AccumulateFunc)(uint64_t *apAcc, const uint8_t *apData, uint32_t aChunks, uint64_t &aCounter);
+
+static void accumulateScalar(uint64_t *apAcc, const uint8_t *apData, uint32_t aChunks, uint64_t &aCounter)
+{
+    for (uint32_t c = 0 ; c < aChunks ; c++) {
+        for (int i = 0 ; i < 4 ; i++) {
+            uint64_t v;
+            std::memcpy(&v, apData + (c * 32) + (i * 8), sizeof(v));
+            uint64_t dk = v ^ (cKEYS[i] + (aCounter * cKEY_STEP));
+            apAcc[i] += ((dk & 0xFFFFFFFF) * (dk >> 32)) + v;
+        }
+        aCounter++;
+    }
+}
+
+#ifdef TILEHASHER_X86
+__attribute__((target("avx2")))
+static void accumulateAVX2(uint64_t *apAcc, const uint8_t *apData, uint32_t aChunks, uint64_t &aCounter)
+{
+    __m256i acc = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(apAcc));
+    __m256i key = _mm256_add_epi64(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cKEYS)),
+        _mm256_set1_epi64x(static_cast<long long>(aCounter * cKEY_STEP)));
+    const __m256i step = _mm256_set1_epi64x(static_cast<long long>(cKEY_STEP));
+
+    for (uint32_t c = 0 ; c < aChunks ; c++) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(apData + (c * 32)));
+        __m256i dk = _mm256_xor_si256(v, key);
+        __m256i product = _mm256_mul_epu32(dk, _mm256_srli_epi64(dk, 32));
+        acc = _mm256_add_epi64(acc, _mm256_add_epi64(product, v));
+        key = _mm256_add_epi64(key, step);
+    }
+    aCounter += aChunks;
+
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(apAcc), acc);
+}
+#endif
+
+static AccumulateFunc selectAccumulate()
+{
+#ifdef TILEHASHER_X86
+    if (RowConverter::GetIsa() >= RowConverter::Isa::AVX2) {
+        return accumulateAVX2;
+    }
+#endif
+    return accumulateScalar;
+}
+
+static inline uint64_t rotl(uint64_t aValue, int aBits)
+{
+    return (aValue << aBits) | (aValue >> (64 - aBits));
+}
+
+static uint64_t hashTile(AccumulateFunc apAccumulate, const uint8_t *apData, uint32_t aPitch, uint32_t aRowBytes, uint32_t aRows,
+    const uint8_t *apWrapped, uint32_t aWrapRow)
+{
+    uint64_t acc[4] = { cKEYS[2], cKEYS[3], cKEYS[0], cKEYS[1] };
+    uint64_t counter = 0;
+    uint32_t chunks = aRowBytes / 32;
+    uint32_t tail = aRowBytes % 32;
+
+    for (uint32_t y = 0 ; y < aRows ; y++) {
+        if (y == aWrapRow) {
+            apData = apWrapped;
+        }
+        apAccumulate(acc, apData, chunks, counter);
+        if (tail) {
+            uint8_t last[32] = {};
+            std::memcpy(last, apData + (chunks * 32), tail);
+            apAccumulate(acc, last, 1, counter);
+        }
+        apData += aPitch;
+    }
+
+    // Fold the lanes, and finish with the murmur3 avalanche
+    uint64_t h = acc[0] ^ rotl(acc[1], 17) ^ rotl(acc[2], 31) ^ rotl(acc[3], 47);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+TileHasher::TileHasher()
+{
+}
+
+void TileHasher::Update(const uint8_t *apPage, const uint8_t *apWrapped, uint32_t aWrapRow, uint32_t aPitch,
+    uint32_t aWidth, uint32_t aHeight, uint32_t aBytesPerPixel, Damage &aDamage, Statistics &aStatistics)
+{
+    static const AccumulateFunc accumulate = selectAccumulate();
+    auto start = std::chrono::steady_clock::now();
+
+    if ((aWidth != mWidth) || (aHeight != mHeight) || (aBytesPerPixel != mBytesPerPixel)) {
+        mWidth = aWidth;
+        mHeight = aHeight;
+        mBytesPerPixel = aBytesPerPixel;
+        mColumns = (aWidth + cTILE_SIZE - 1) / cTILE_SIZE;
+        size_t tiles = size_t(mColumns) * ((aHeight + cTILE_SIZE - 1) / cTILE_SIZE);
+        mHashes.assign(tiles, 0);
+        mValid.assign(tiles, false);
+    }
+
+    aDamage.Clear();
+
+    size_t index = 0;
+    uint64_t unchanged = 0;
+    for (uint32_t y = 0 ; y < aHeight ; y += cTILE_SIZE) {
+        uint32_t h = std::min(cTILE_SIZE, aHeight - y);
+        for (uint32_t x = 0 ; x < aWidth ; x += cTILE_SIZE, index++) {
+            uint32_t w = std::min(cTILE_SIZE, aWidth - x);
+            // Tiles crossing the wrap continue at the top of video memory
+            const uint8_t *wrapped = apWrapped + (size_t(x) * aBytesPerPixel);
+            const uint8_t *tile;
+            uint32_t wrap;
+            if (y < aWrapRow) {
+                tile = apPage + (size_t(y) * aPitch) + (size_t(x) * aBytesPerPixel);
+                wrap = aWrapRow - y;
+            } else {
+                tile = wrapped + (size_t(y - aWrapRow) * aPitch);
+                wrap = h;
+            }
+            uint64_t hash = hashTile(accumulate, tile, aPitch, w * aBytesPerPixel, h, wrapped, wrap);
+
+            if (mValid[index] && (mHashes[index] == hash)) {
+                unchanged++;
+                continue;
+            }
+            mHashes[index] = hash;
+            mValid[index] = true;
+            aDamage.Add({ x, y, w, h });
+        }
+    }
+
+    aStatistics.frames++;
+    aStatistics.tiles += index;
+    aStatistics.unchangedTiles += unchanged;
+    aStatistics.hashNanoSeconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+    LOG("Tile hash: ", unchanged, " of ", index, " tiles unchanged");
+}
+
+void TileHasher::Invalidate(const Damage &aDamage)
+{
+    if (aDamage.IsFull()) {
+        mValid.assign(mValid.size(), false);
+        return;
+    }
+
+    for (const Damage::Rect &r : aDamage.GetRects()) {
+        uint32_t x2 = std::min(r.x + r.w, mWidth);
+        uint32_t y2 = std::min(r.y + r.h, mHeight);
+        for (uint32_t ty = r.y / cTILE_SIZE ; ty * cTILE_SIZE < y2 ; ty++) {
+            for (uint32_t tx = r.x / cTILE_SIZE ; tx * cTILE_SIZE < x2 ; tx++) {
+                mValid[(ty * mColumns) + tx] = false;
+            }
+        }
+    }
+}
+
+void TileHasher::Statistics::Print(std::ostream &aStream) const
+{
+    double hit_rate = tiles ? (100.0 * unchangedTiles / tiles) : 0.0;
+    double hash_ms = hashNanoSeconds / 1e6;
+
+    aStream << "Tile hash: " << frames << " frames, " << tiles << " tiles, "
+            << hit_rate << "% unchanged, " << hash_ms << " ms hashing ("
+            << (frames ? hash_ms / frames : 0.0) << " ms/frame)" << std::endl;
+}
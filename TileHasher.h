@@ -0,0 +1,94 @@
+/*
+ * TileHasher.h
+ *
+ * Copyright (C) 2021 RSP Systems <software@rspsystems.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef TILEHASHER_H_
+#define TILEHASHER_H_
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+#include "Damage.h"
+
+/**
+ * \class TileHasher
+ * \brief Change detection for frames without damage information.
+ *        The visible page is split into tiles, and each tile is hashed and
+ *        compared with the hash of the tile in the previous frame.
+ */
+class TileHasher
+{
+public:
+    /** Width and height of a tile in pixels */
+    static const uint32_t cTILE_SIZE = 64;
+
+    /**
+     * \struct Statistics
+     * \brief Counters shared by all hashers of a view.
+     */
+    struct Statistics {
+        uint64_t frames = 0;
+        uint64_t tiles = 0;
+        uint64_t unchangedTiles = 0;
+        uint64_t hashNanoSeconds = 0;
+
+        /**
+         * \fn void Print(std::ostream&)
+         * \brief Print the hit rate, and the time spent hashing.
+         */
+        void Print(std::ostream &aStream) const;
+    };
+
+    TileHasher();
+
+    /**
+     * \fn void Update(const uint8_t*, const uint8_t*, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, Damage&, Statistics&)
+     * \brief Hash all tiles of a page, and replace the damage with the tiles
+     *        that changed since the previous call.
+     *
+     * \param apPage Address of the first pixel of the visible page
+     * \param apWrapped Address of row aWrapRow, for a page wrapping around the end of video memory
+     * \param aWrapRow First row read from apWrapped, aHeight if the page does not wrap
+     * \param aPitch Bytes between rows
+     * \param aWidth in pixels
+     * \param aHeight in pixels
+     * \param aBytesPerPixel
+     * \param aDamage Output
+     * \param aStatistics Counters to update
+     */
+    void Update(const uint8_t *apPage, const uint8_t *apWrapped, uint32_t aWrapRow, uint32_t aPitch,
+        uint32_t aWidth, uint32_t aHeight, uint32_t aBytesPerPixel, Damage &aDamage, Statistics &aStatistics);
+
+    /**
+     * \fn void Invalidate(const Damage&)
+     * \brief Forget the hashes of tiles redrawn by other means, so they are
+     *        reported as changed on the next Update().
+     *
+     * \param aDamage
+     */
+    void Invalidate(const Damage &aDamage);
+
+protected:
+    uint32_t mWidth = 0;
+    uint32_t mHeight = 0;
+    uint32_t mBytesPerPixel = 0;
+    uint32_t mColumns = 0;
+    std::vector<uint64_t> mHashes;
+    std::vector<bool> mValid;
+};
+
+#endif /* TILEHASHER_H_ */
@@ -23,11 +23,18 @@
 #include <sys/mman.h>
 #include <system_error>
 #include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <thread>
 #include "Epoll.h"
 #include "ViewBase.h"
+#include "driver/vfb2.h"
 #include "log.h"
 
-ViewBase::ViewBase(const std::string aFrameBufferName, const std::string aViewDeviceName)
+ViewBase::ViewBase(const std::string aFrameBufferName, const std::string aViewDeviceName, const ViewOptions &aOptions)
+    : mOptions(aOptions)
 {
     LOG("Emulating frame buffer in ", aFrameBufferName, " with view in ", aViewDeviceName);
 
@@ -52,9 +59,20 @@ ViewBase::ViewBase(const std::string aFrameBufferName, const std::string aViewDe
 
     LOG("smem_start: ", mFbFix.smem_start, ", smem_len: ", mFbFix.smem_len, ", bpp: ", mFbVar.bits_per_pixel);
 
-    // We only support 32-bit colors for now.
-    if (mFbVar.bits_per_pixel != 32) {
-        throw std::runtime_error("Frame buffer reports unsupported color depth.");
+    struct vfb_screeninfo info;
+    if (ReadScreenInfo(info)) {
+        mSmemSeq = info.smem_seq;
+    }
+
+    // Throws if the pixel layout is not supported
+    mConverter.Configure(mFbVar);
+    std::clog << "Row conversion: " << mConverter.GetKernelName() << std::endl;
+    if (mConverter.UsesPalette()) {
+        ReadPalette();
+    }
+    ConfigureRotation();
+    if (mRotator.IsEnabled()) {
+        std::clog << "Rotation: " << mRotator.GetKernelName() << std::endl;
     }
 
 //    void *p = mmap((void*)mFbFix.smem_start, mFbFix.smem_len, PROT_READ, MAP_SHARED, mFrameBufFd, 0);
@@ -64,10 +82,52 @@ ViewBase::ViewBase(const std::string aFrameBufferName, const std::string aViewDe
     }
 
     mpBuffer = static_cast<uint32_t*>(p);
+
+    uint32_t version = VFB_EVENT_VERSION;
+    if (ioctl(mViewFd, VFB_IOCTL_SET_PROTOCOL, &version) == 0) {
+        mEventProtocol = true;
+        std::clog << "Using event protocol version " << version << std::endl;
+
+        // Older drivers cannot map the ring, events are then read()
+        p = mmap(0, sizeof(struct vfb_ring), PROT_READ | PROT_WRITE, MAP_SHARED, mViewFd, 0);
+        if (p != reinterpret_cast<void*>(-1)) {
+            mpRing = static_cast<struct vfb_ring*>(p);
+            if ((mpRing->version == VFB_EVENT_VERSION) && (mpRing->len == VFB_RING_LEN)) {
+                std::clog << "Using shared event ring of " << mpRing->len << " events" << std::endl;
+            } else {
+                munmap(mpRing, sizeof(struct vfb_ring));
+                mpRing = nullptr;
+            }
+        }
+    }
+
+    if (MapSnapshot()) {
+        std::clog << "Using " << mpSnapshot->count << " snapshots taken at pans" << std::endl;
+    }
+
+    struct vfb_dirty_pages dirty = {};
+    if (ioctl(mViewFd, VFB_IOCTL_GET_DIRTY_PAGES, &dirty) == 0) {
+        mDirtyPages = true;
+        mPageSize = dirty.page_size;
+        mDirtyBitmap.resize((dirty.count + 31) / 32);
+        std::clog << "Using dirty page tracking of " << dirty.count << " pages" << std::endl;
+    }
 }
 
 ViewBase::~ViewBase()
 {
+    if (mpRing) {
+        munmap(mpRing, sizeof(struct vfb_ring));
+    }
+
+    if (mpSnapshot) {
+        munmap(mpSnapshot, mSnapshotSize);
+    }
+
+    for (const RetiredMapping &mapping : mRetiredMappings) {
+        munmap(mapping.pAddress, mapping.size);
+    }
+
     if (mViewFd > 0) {
         close(mViewFd);
     }
@@ -83,20 +143,790 @@ void ViewBase::run()
     struct epoll_event events[cMAX_EVENTS];
 
     Epoll ep;
-    ep.Add(mViewFd, EPOLLIN);
-    int counts = 1;
-
-    while (PollEvents()) {
-        if (counts > 0) {
-            size_t bytes = read(mViewFd, &mFbVar, sizeof(mFbVar));
-            if (bytes == -1) {
-                throw std::system_error(errno, std::generic_category(), "Failed to read from fb_view");
+    ep.Add(mFrameReady);
+    // Block until something happens, unless the implementation can not tell
+    int timeout = AddEventSources(ep) ? -1 : 10;
+
+    mRunning = true;
+    std::thread converter(&ViewBase::ConvertLoop, this);
+    auto stop = [&]() {
+        mRunning = false;
+        mStop.Signal();
+        converter.join();
+    };
+
+    try {
+        while (mRunning) {
+            mFrameReady.Clear();
+            Frame *frame = mQueue.Acquire();
+            if (frame) {
+                auto start = mQueueTimer.Add(frame->publishTime);
+                Resize(frame->var.xres, frame->var.yres);
+                Upload(*frame);
+                mUploadedFrame.store(frame->sequence, std::memory_order_release);
+                start = mUploadTimer.Add(start);
+                Present();
+                mPresentTimer.Add(start);
+                AcknowledgeFrame(*frame);
+            }
+            // Rendering may have queued window events without them being
+            // signaled, so always handle events before waiting
+            if (!PollEvents()) {
+                break;
+            }
+            ep.Wait(events, cMAX_EVENTS, timeout);
+        }
+    }
+    catch (...) {
+        stop();
+        throw;
+    }
+
+    stop();
+    if (mConvertError) {
+        std::rethrow_exception(mConvertError);
+    }
+
+    if (mOptions.tileHash) {
+        mTileStatistics.Print(std::clog);
+    }
+    if (mOptions.statistics) {
+        PrintStatistics();
+    }
+}
+
+void ViewBase::ConvertLoop()
+{
+    const int cMAX_EVENTS = 4;
+    struct epoll_event events[cMAX_EVENTS];
+
+    try {
+        Epoll ep;
+        int fd = mViewEvent.GetFd();
+        if (ioctl(mViewFd, VFB_IOCTL_SET_EVENTFD, &fd) == 0) {
+            ep.Add(mViewEvent);
+            std::clog << "Using eventfd notification" << std::endl;
+        } else {
+            ep.Add(mViewFd, EPOLLIN);
+        }
+        ep.Add(mScheduler.GetFd(), EPOLLIN);
+        ep.Add(mStop);
+        ep.Add(mRedraw);
+
+        ReadNotification();
+        ConvertFrame();
+
+        while (mRunning) {
+            int counts = ep.Wait(events, cMAX_EVENTS, -1);
+            bool convert = false;
+            for (int i = 0 ; i < counts ; i++) {
+                if (events[i].data.fd == mViewFd) {
+                    // Damage accumulates in the pages until the next frame
+                    convert |= ReadNotification();
+                } else if (events[i].data.fd == mViewEvent.GetFd()) {
+                    // One read covers any number of signals
+                    mViewEvent.Clear();
+                    convert |= ReadNotification();
+                } else if (events[i].data.fd == mScheduler.GetFd()) {
+                    convert |= mScheduler.Expired();
+                } else if (events[i].data.fd == mRedraw.GetFd()) {
+                    mRedraw.Clear();
+                    for (Page &page : mPages) {
+                        page.pending.SetFull();
+                        page.hasher.Invalidate(page.pending);
+                    }
+                    convert = true;
+                }
+            }
+            if (convert && mRunning) {
+                ConvertFrame();
+            }
+        }
+    }
+    catch (...) {
+        mConvertError = std::current_exception();
+        mRunning = false;
+        try {
+            mFrameReady.Signal();
+        }
+        catch (...) {
+        }
+    }
+}
+
+bool ViewBase::ReadNotification()
+{
+    auto start = StageTimer::Clock::now();
+    ReadViewDevice();
+    mReadTime = mReadTimer.Add(start);
+
+    auto interval = FrameScheduler::GetRefreshInterval(mFbVar);
+    if (mOptions.refreshRate > 0) {
+        interval = std::chrono::duration_cast<FrameScheduler::Clock::duration>(
+            std::chrono::duration<double>(1.0 / mOptions.refreshRate));
+    }
+    if (interval <= FrameScheduler::Clock::duration::zero()) {
+        // No timings in the mode
+        interval = std::chrono::duration_cast<FrameScheduler::Clock::duration>(std::chrono::duration<double>(1.0 / 60));
+    }
+    if (interval != mScheduler.GetInterval()) {
+        mScheduler.SetInterval(interval);
+        std::clog << "Frame pacing: " << (1.0 / std::chrono::duration<double>(interval).count()) << " Hz" << std::endl;
+    }
+
+    return mScheduler.Notify();
+}
+
+void ViewBase::ConvertFrame()
+{
+    auto start = StageTimer::Clock::now();
+
+    if (mQueue.Reclaim()) {
+        // The render thread never got to the previous frame, so its damage
+        // has not reached the output. Pages are only cleared by a mode
+        // change, and only added by SelectPage(), so a page index still in
+        // range refers to the same page.
+        Frame &dropped = mQueue.GetBack();
+        if (dropped.pageIndex < mPages.size()) {
+            Page &page = mPages[dropped.pageIndex];
+            Damage damage = mRotator.UnmapDamage(dropped.damage, mFbVar.xres, mFbVar.yres);
+            page.pending.Add(damage);
+            page.hasher.Invalidate(damage);
+        }
+        mDroppedFrames++;
+    }
+
+    ReleaseMappings();
+    SelectPage();
+    LOG("Page ", mPageIndex, ", damaged rectangles: ", mDamage.IsFull() ? -1 : int(mDamage.GetRects().size()));
+
+    const uint8_t *page = GetVisiblePage();
+    const uint8_t *wrapped = GetWrappedPage();
+    uint32_t wrap_row = GetWrapRow();
+    uint32_t snapshot_seq = 0;
+    const struct vfb_snapshot_slot *snapshot = FindSnapshot(snapshot_seq);
+    if (snapshot) {
+        // The driver copies wrapped rows in order
+        page = reinterpret_cast<const uint8_t*>(mpSnapshot) + snapshot->offset
+            + (snapshot->xoffset * (mFbVar.bits_per_pixel / 8));
+        wrap_row = mFbVar.yres;
+        // Writes after the previous pan are only in the new copy, and their
+        // damage may already have been used, so redraw the page
+        if (snapshot->pan_seq != mSnapshotPanSeq) {
+            mSnapshotPanSeq = snapshot->pan_seq;
+            mDamage.SetFull();
+        }
+    }
+
+    if (mOptions.tileHash) {
+        TileHasher &hasher = mPages[mPageIndex].hasher;
+        if (mDamage.IsFull()) {
+            hasher.Update(page, wrapped, wrap_row, mFbFix.line_length, mFbVar.xres, mFbVar.yres,
+                mFbVar.bits_per_pixel / 8, mDamage, mTileStatistics);
+        } else {
+            hasher.Invalidate(mDamage);
+        }
+        start = mHashTimer.Add(start);
+    }
+
+    Frame &frame = mQueue.GetBack();
+    frame.var = mFbVar;
+    frame.pageIndex = mPageIndex;
+    frame.damage = mRotator.MapDamage(mDamage, mFbVar.xres, mFbVar.yres);
+    if (mRotator.SwapsAxes()) {
+        std::swap(frame.var.xres, frame.var.yres);
+    }
+    frame.sequence = mFrames;
+    frame.panSeq = mPanSeq;
+    frame.readTime = mReadTime;
+
+    if (mConverter.IsIdentity() && !snapshot && !mRotator.IsEnabled()) {
+        // The render thread uploads straight from the frame buffer, in two
+        // spans if the page wraps
+        frame.pPixels = page;
+        frame.pitch = mFbFix.line_length;
+        frame.pWrapped = wrapped;
+        frame.wrapRow = wrap_row;
+    } else {
+        // Only the damaged areas of the staging buffer are valid
+        frame.staging.resize(size_t(mFbVar.xres) * mFbVar.yres);
+        frame.pitch = frame.var.xres * sizeof(uint32_t);
+        frame.pPixels = reinterpret_cast<const uint8_t*>(frame.staging.data());
+        frame.pWrapped = nullptr;
+        frame.wrapRow = UINT32_MAX;
+
+        const uint32_t bytes_pp = mFbVar.bits_per_pixel / 8;
+        std::vector<Damage::Rect> rects = mDamage.GetRects(mFbVar.xres, mFbVar.yres);
+        if (mDamageMargin) {
+            for (Damage::Rect &r : rects) {
+                uint32_t x2 = std::min(r.x + r.w + mDamageMargin, mFbVar.xres);
+                uint32_t y2 = std::min(r.y + r.h + mDamageMargin, mFbVar.yres);
+                r.x -= std::min(r.x, mDamageMargin);
+                r.y -= std::min(r.y, mDamageMargin);
+                r.w = x2 - r.x;
+                r.h = y2 - r.y;
+            }
+        }
+        // A wrapped page is converted as two spans of contiguous rows
+        for (const Damage::Rect &r : Damage::SplitRows(rects, wrap_row)) {
+            const uint8_t *src = (r.y < wrap_row) ? page + (r.y * mFbFix.line_length)
+                : wrapped + ((r.y - wrap_row) * mFbFix.line_length);
+            src += r.x * bytes_pp;
+            if (mRotator.IsEnabled()) {
+                ConvertRotated(frame, src, r);
+                continue;
+            }
+            uint32_t *dst = frame.staging.data() + (size_t(r.y) * mFbVar.xres) + r.x;
+            mConverter.Convert(dst, frame.pitch, src, mFbFix.line_length, r.w, r.h);
+        }
+    }
+
+    if (snapshot && !SnapshotValid(*snapshot, snapshot_seq)) {
+        // The producer panned through all slots while we copied, so the frame
+        // is dropped. The notifications of those pans convert a newer copy.
+        Page &dropped = mPages[mPageIndex];
+        dropped.pending.SetFull();
+        dropped.hasher.Invalidate(dropped.pending);
+        mSnapshotPanSeq = 0;
+        mTornSnapshots++;
+        // Still a conversion, so the scheduler keeps pacing from it
+        mScheduler.FrameDone();
+        return;
+    }
+
+    frame.publishTime = mConvertTimer.Add(start);
+    mQueue.Publish();
+    mFrameReady.Signal();
+    mScheduler.FrameDone();
+}
+
+void ViewBase::ConvertRotated(Frame &arFrame, const uint8_t *apSrc, const Damage::Rect &arRect)
+{
+    const uint32_t band_pitch = arRect.w * sizeof(uint32_t);
+    mBand.resize(size_t(arRect.w) * Rotator::cBAND_ROWS);
+
+    for (uint32_t y = 0 ; y < arRect.h ; y += Rotator::cBAND_ROWS) {
+        uint32_t h = std::min(Rotator::cBAND_ROWS, arRect.h - y);
+        mConverter.Convert(mBand.data(), band_pitch, apSrc + (y * mFbFix.line_length), mFbFix.line_length, arRect.w, h);
+
+        Damage::Rect d = mRotator.MapRect({ arRect.x, arRect.y + y, arRect.w, h }, mFbVar.xres, mFbVar.yres);
+        uint32_t *dst = arFrame.staging.data() + (size_t(d.y) * arFrame.var.xres) + d.x;
+        mRotator.Rotate(dst, arFrame.pitch, mBand.data(), band_pitch, arRect.w, h);
+    }
+}
+
+void ViewBase::ConfigureRotation()
+{
+    mRotator.Configure((mOptions.rotate >= 0) ? uint32_t(mOptions.rotate) : mFbVar.rotate);
+}
+
+void ViewBase::RequestRedraw()
+{
+    mRedraw.Signal();
+}
+
+void ViewBase::AcknowledgeFrame(const Frame &aFrame)
+{
+    if (!mFlipAck || (aFrame.panSeq == 0)) {
+        return;
+    }
+
+    struct vfb_flip_ack ack = {};
+    ack.seq = aFrame.panSeq;
+    if (ioctl(mViewFd, VFB_IOCTL_ACK_FLIP, &ack) == -1) {
+        if (errno != ENOTTY) {
+            throw std::system_error(errno, std::generic_category(), "Failed to acknowledge flip");
+        }
+        mFlipAck = false;
+        return;
+    }
+    if (ack.latency_ns) {
+        mFlipTimer.Add(std::chrono::nanoseconds(ack.latency_ns));
+    }
+}
+
+void ViewBase::PrintStatistics() const
+{
+    if (mEventProtocol) {
+        std::clog << "Events: " << mEventSeq << " sequence, " << mLostEvents << " lost" << std::endl;
+        mEventTimer.Print(std::clog);
+    }
+    if (mpSnapshot) {
+        std::clog << "Snapshots: " << mTornSnapshots << " frames dropped, copy overwritten" << std::endl;
+    }
+    std::clog << "Pipeline: " << mScheduler.GetNotifications() << " notifications, "
+              << mFrames << " frames converted, " << mScheduler.GetCoalesced() << " notifications coalesced, "
+              << mDroppedFrames << " frames dropped" << std::endl;
+    mReadTimer.Print(std::clog);
+    if (mOptions.tileHash) {
+        mHashTimer.Print(std::clog);
+    }
+    mConvertTimer.Print(std::clog);
+    mQueueTimer.Print(std::clog);
+    mUploadTimer.Print(std::clog);
+    mPresentTimer.Print(std::clog);
+    if (mFlipAck) {
+        mFlipTimer.Print(std::clog);
+    }
+}
+
+void ViewBase::RemapFrameBuffer()
+{
+    struct fb_fix_screeninfo fix = mFbFix;
+    bool replaced;
+    struct vfb_screeninfo info;
+    if (ReadScreenInfo(info)) {
+        fix.line_length = info.line_length;
+        fix.smem_len = info.smem_len;
+        replaced = (info.smem_seq != mSmemSeq);
+        mSmemSeq = info.smem_seq;
+    } else {
+        if (ioctl(mFrameBufFd, FBIOGET_FSCREENINFO, &fix) == -1) {
+            throw std::system_error(errno, std::generic_category(), "Failed to get fixed screen info");
+        }
+        replaced = (fix.smem_start != mFbFix.smem_start) || (fix.smem_len != mFbFix.smem_len);
+    }
+
+    if (replaced) {
+        // The driver allocated new video memory for the mode. The old mapping
+        // stays valid, and is kept until no frame refers to it.
+        void *p = mmap(0, fix.smem_len, PROT_READ, MAP_SHARED, mFrameBufFd, 0);
+        if (p == reinterpret_cast<void*>(-1)) {
+            throw std::system_error(errno, std::generic_category(), "Failed to mmap frame buffer");
+        }
+        mRetiredMappings.push_back({ mpBuffer, mFbFix.smem_len, mFrames });
+        mpBuffer = static_cast<uint32_t*>(p);
+        LOG("Frame buffer remapped, smem_len: ", fix.smem_len);
+    }
+    mFbFix = fix;
+
+    // Snapshots are only read by this thread, so they are replaced at once
+    if (mpSnapshot) {
+        munmap(mpSnapshot, mSnapshotSize);
+        mpSnapshot = nullptr;
+        mSnapshotPanSeq = 0;
+        MapSnapshot();
+    }
+}
+
+void ViewBase::ReleaseMappings()
+{
+    uint64_t uploaded = mUploadedFrame.load(std::memory_order_acquire);
+    std::erase_if(mRetiredMappings, [uploaded](const RetiredMapping &arMapping) {
+        if (arMapping.lastFrame >= uploaded) {
+            return false;
+        }
+        munmap(arMapping.pAddress, arMapping.size);
+        return true;
+    });
+}
+
+bool ViewBase::MapSnapshot()
+{
+    // Fails unless the driver was loaded with snapshot=N
+    void *p = mmap(0, sizeof(struct vfb_snapshot), PROT_READ, MAP_SHARED, mViewFd, VFB_SNAPSHOT_OFFSET);
+    if (p == reinterpret_cast<void*>(-1)) {
+        return false;
+    }
+
+    const struct vfb_snapshot *header = static_cast<const struct vfb_snapshot*>(p);
+    size_t size = header->size;
+    bool valid = (header->version == VFB_SNAPSHOT_VERSION) && header->count
+        && (header->count <= VFB_SNAPSHOT_MAX_SLOTS);
+    munmap(p, sizeof(struct vfb_snapshot));
+    if (!valid) {
+        return false;
+    }
+
+    p = mmap(0, size, PROT_READ, MAP_SHARED, mViewFd, VFB_SNAPSHOT_OFFSET);
+    if (p == reinterpret_cast<void*>(-1)) {
+        throw std::system_error(errno, std::generic_category(), "Failed to mmap snapshots");
+    }
+    mpSnapshot = static_cast<struct vfb_snapshot*>(p);
+    mSnapshotSize = size;
+    return true;
+}
+
+const struct vfb_snapshot_slot* ViewBase::FindSnapshot(uint32_t &arSeq) const
+{
+    if (!mpSnapshot) {
+        return nullptr;
+    }
+
+    // The newest copy of a pan not after the one being shown, which with
+    // pan_at_vblank may be older than the newest copy
+    const struct vfb_snapshot_slot *found = nullptr;
+    for (uint32_t i = 0 ; i < mpSnapshot->count ; i++) {
+        struct vfb_snapshot_slot &slot = mpSnapshot->slots[i];
+        uint32_t seq = std::atomic_ref<uint32_t>(slot.seq).load(std::memory_order_acquire);
+        if ((seq == 0) || (seq & 1) || (int32_t(slot.pan_seq - mPanSeq) > 0)) {
+            continue;
+        }
+        if (!found || (int32_t(slot.pan_seq - found->pan_seq) > 0)) {
+            found = &slot;
+            arSeq = seq;
+        }
+    }
+
+    // Copies from before a mode change are not used
+    if (found && ((found->line_length != mFbFix.line_length) || (found->yres != mFbVar.yres)
+        || (found->xres != mFbVar.xres) || (found->bits_per_pixel != mFbVar.bits_per_pixel))) {
+        found = nullptr;
+    }
+    return found;
+}
+
+bool ViewBase::SnapshotValid(const struct vfb_snapshot_slot &arSlot, uint32_t aSeq) const
+{
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return std::atomic_ref<uint32_t>(const_cast<uint32_t&>(arSlot.seq)).load(std::memory_order_relaxed) == aSeq;
+}
+
+const uint8_t* ViewBase::GetVisiblePage() const
+{
+    return reinterpret_cast<const uint8_t*>(mpBuffer)
+        + (mFbVar.yoffset * mFbFix.line_length)
+        + (mFbVar.xoffset * (mFbVar.bits_per_pixel / 8));
+}
+
+uint32_t ViewBase::GetWrapRow() const
+{
+    if (mFbVar.yoffset + mFbVar.yres > mFbVar.yres_virtual) {
+        return mFbVar.yres_virtual - std::min(mFbVar.yoffset, mFbVar.yres_virtual);
+    }
+    return mFbVar.yres;
+}
+
+const uint8_t* ViewBase::GetWrappedPage() const
+{
+    return reinterpret_cast<const uint8_t*>(mpBuffer) + (mFbVar.xoffset * (mFbVar.bits_per_pixel / 8));
+}
+
+
+void ViewBase::ReadViewDevice()
+{
+    if (mEventProtocol) {
+        ReadEvents();
+    } else {
+        ReadLegacy();
+    }
+
+    // Color map changes are only notified as events, so look for them on
+    // every read of the previous format
+    if (!mEventProtocol && mConverter.UsesPalette() && ReadPalette()) {
+        for (Page &page : mPages) {
+            page.pending.SetFull();
+        }
+    }
+
+    if (mDirtyPages) {
+        ReadDirtyPages();
+    }
+}
+
+void ViewBase::ReadLegacy()
+{
+    struct {
+        struct fb_var_screeninfo var;
+        struct vfb_damage damage;
+    } msg = {};
+    ssize_t bytes = -1;
+
+    if (mDriverDamage) {
+        bytes = read(mViewFd, &msg, sizeof(msg));
+        if ((bytes == -1) && (errno == ENOBUFS)) {
+            std::clog << "vfb2 driver does not report damage, redrawing full frames" << std::endl;
+            mDriverDamage = false;
+        }
+    }
+    if (!mDriverDamage) {
+        bytes = read(mViewFd, &msg.var, sizeof(msg.var));
+        // Nothing is known about what changed
+        msg.damage.flags = VFB_DAMAGE_FULL;
+    }
+    if (bytes == -1) {
+        throw std::system_error(errno, std::generic_category(), "Failed to read from fb_view");
+    }
+    LOG("Read: ", bytes, ", yoffset: ", msg.var.yoffset);
+
+    ProcessNotification(msg.var, msg.damage);
+}
+
+void ViewBase::ReadEvents()
+{
+    if (mpRing) {
+        ReadRing();
+        return;
+    }
+
+    ssize_t bytes = read(mViewFd, mEventBuffer, sizeof(mEventBuffer));
+    if (bytes == -1) {
+        throw std::system_error(errno, std::generic_category(), "Failed to read from fb_view");
+    }
+    LOG("Read: ", bytes, " bytes of events");
+
+    auto now = StageTimer::Clock::now();
+    const uint8_t *p = reinterpret_cast<const uint8_t*>(mEventBuffer);
+    const uint8_t *end = p + bytes;
+    while ((p + offsetof(struct vfb_event, seq)) <= end) {
+        struct vfb_event ev = {};
+        std::memcpy(&ev, p, offsetof(struct vfb_event, seq));
+        if ((ev.size < offsetof(struct vfb_event, seq)) || ((p + ev.size) > end)) {
+            throw std::runtime_error("Malformed event from fb_view");
+        }
+        std::memcpy(&ev, p, std::min<size_t>(ev.size, sizeof(ev)));
+        p += ev.size;
+
+        ProcessEvent(ev, now);
+    }
+}
+
+void ViewBase::ReadRing()
+{
+    std::atomic_ref<uint32_t> head(mpRing->head);
+    std::atomic_ref<uint32_t> tail(mpRing->tail);
+    uint32_t pos = tail.load(std::memory_order_relaxed);
+    uint32_t end = head.load(std::memory_order_acquire);
+
+    if (pos == end) {
+        // Damage from drawing only enters the ring when the device is polled or
+        // read. Before signaling the eventfd the driver moves it there itself.
+        if (read(mViewFd, mEventBuffer, sizeof(mEventBuffer)) == -1) {
+            throw std::system_error(errno, std::generic_category(), "Failed to read from fb_view");
+        }
+        end = head.load(std::memory_order_acquire);
+    }
+    LOG("Ring: ", end - pos, " events");
+
+    auto now = StageTimer::Clock::now();
+    while (pos != end) {
+        struct vfb_event ev;
+        std::memcpy(&ev, &mpRing->events[pos % VFB_RING_LEN], sizeof(ev));
+        tail.store(++pos, std::memory_order_release);
+
+        ProcessEvent(ev, now);
+
+        // Keep going while the producer adds events, without a system call.
+        // They were stored after now was taken, so take it again.
+        if (pos == end) {
+            end = head.load(std::memory_order_acquire);
+            now = StageTimer::Clock::now();
+        }
+    }
+}
+
+void ViewBase::ProcessEvent(const struct vfb_event &arEvent, StageTimer::Clock::time_point aNow)
+{
+    if (arEvent.version != VFB_EVENT_VERSION) {
+        return;
+    }
+
+    if (mEventSeq && (arEvent.seq != mEventSeq + 1)) {
+        mLostEvents += arEvent.seq - mEventSeq - 1;
+    }
+    mEventSeq = arEvent.seq;
+    mEventTimer.Add(aNow - StageTimer::Clock::time_point(std::chrono::nanoseconds(arEvent.timestamp_ns)));
+
+    struct fb_var_screeninfo var = mFbVar;
+    if (arEvent.flags & VFB_EVENT_MODE_CHANGE) {
+        struct vfb_screeninfo info;
+        if (ReadScreenInfo(info)) {
+            var = info.var;
+        } else if (ioctl(mFrameBufFd, FBIOGET_VSCREENINFO, &var) == -1) {
+            throw std::system_error(errno, std::generic_category(), "Failed to get variable screen info");
+        }
+    }
+    var.xoffset = arEvent.xoffset;
+    var.yoffset = arEvent.yoffset;
+    var.vmode = arEvent.vmode;
+
+    // The event has full damage, which redraws every page with the new colors
+    if ((arEvent.flags & VFB_EVENT_PALETTE) && mConverter.UsesPalette()) {
+        ReadPalette();
+    }
+
+    struct vfb_damage damage = {};
+    damage.flags = ((arEvent.flags & VFB_EVENT_PAN) ? VFB_DAMAGE_PANNED : 0)
+        | ((arEvent.flags & VFB_EVENT_DAMAGE_FULL) ? VFB_DAMAGE_FULL : 0);
+    damage.count = std::min<uint32_t>(arEvent.damage_count, VFB_MAX_DAMAGE_RECTS);
+    damage.pan_seq = arEvent.pan_seq;
+    std::memcpy(damage.rects, arEvent.rects, sizeof(damage.rects));
+
+    ProcessNotification(var, damage);
+}
+
+void ViewBase::ProcessNotification(const struct fb_var_screeninfo &aVar, const struct vfb_damage &aDamage)
+{
+    bool mode_changed = (aVar.xres != mFbVar.xres)
+        || (aVar.yres != mFbVar.yres)
+        || (aVar.xres_virtual != mFbVar.xres_virtual)
+        || (aVar.yres_virtual != mFbVar.yres_virtual)
+        || (aVar.bits_per_pixel != mFbVar.bits_per_pixel)
+        || !SameBitfield(aVar.red, mFbVar.red)
+        || !SameBitfield(aVar.green, mFbVar.green)
+        || !SameBitfield(aVar.blue, mFbVar.blue)
+        || (aVar.rotate != mFbVar.rotate);
+
+    mFbVar = aVar;
+    if (mode_changed) {
+        // Cached pages, line_length, the mapping, the row kernel and the
+        // rotation all depend on the mode
+        mPages.clear();
+        RemapFrameBuffer();
+        mConverter.Configure(mFbVar);
+        ConfigureRotation();
+        std::clog << "Mode changed to " << mFbVar.xres << "x" << mFbVar.yres << "-" << mFbVar.bits_per_pixel
+                  << ", row conversion: " << mConverter.GetKernelName()
+                  << ", rotation: " << mRotator.GetKernelName() << std::endl;
+        if (mConverter.UsesPalette()) {
+            ReadPalette();
+        }
+    }
+
+    mPanSeq = aDamage.pan_seq;
+
+    // Unless the driver tracks dirty pages, writes through mmap are invisible
+    // to it, so a pan means the producer may have drawn anywhere.
+    bool pan_redraw = (aDamage.flags & VFB_DAMAGE_PANNED) && !mDirtyPages;
+    if (pan_redraw || (aDamage.flags & VFB_DAMAGE_FULL)) {
+        for (Page &page : mPages) {
+            page.pending.SetFull();
+        }
+    } else {
+        uint32_t count = std::min<uint32_t>(aDamage.count, VFB_MAX_DAMAGE_RECTS);
+        for (uint32_t i = 0 ; i < count ; i++) {
+            const struct vfb_rect &r = aDamage.rects[i];
+            AddDamage(r.x, r.y, r.width, r.height);
+        }
+    }
+}
+
+bool ViewBase::SameBitfield(const struct fb_bitfield &arA, const struct fb_bitfield &arB)
+{
+    return (arA.offset == arB.offset) && (arA.length == arB.length) && (arA.msb_right == arB.msb_right);
+}
+
+void ViewBase::AddDamage(uint32_t aX, uint32_t aY, uint32_t aWidth, uint32_t aHeight)
+{
+    for (Page &page : mPages) {
+        // Clip to the page, and translate to page coordinates
+        uint32_t x1 = std::max(aX, page.xoffset);
+        uint32_t y1 = std::max(aY, page.yoffset);
+        uint32_t x2 = std::min(aX + aWidth, page.xoffset + mFbVar.xres);
+        uint32_t y2 = std::min(aY + aHeight, page.yoffset + mFbVar.yres);
+        if ((x1 < x2) && (y1 < y2)) {
+            page.pending.Add({ x1 - page.xoffset, y1 - page.yoffset, x2 - x1, y2 - y1 });
+        }
+    }
+}
+
+void ViewBase::SelectPage()
+{
+    mFrames++;
+
+    size_t pages = size_t(mFbVar.xres_virtual / std::max(mFbVar.xres, 1u))
+        * (mFbVar.yres_virtual / std::max(mFbVar.yres, 1u));
+    size_t limit = std::max<size_t>(std::min(mMaxPages, pages), 1);
+
+    size_t index = 0;
+    while ((index < mPages.size())
+        && ((mPages[index].xoffset != mFbVar.xoffset) || (mPages[index].yoffset != mFbVar.yoffset))) {
+        index++;
+    }
+
+    if (index == mPages.size()) {
+        if (mPages.size() < limit) {
+            mPages.emplace_back();
+        } else {
+            // Reuse the least recently shown page. Its tile hashes are kept,
+            // as they still describe what the implementation has cached.
+            index = 0;
+            for (size_t i = 1 ; i < mPages.size() ; i++) {
+                if (mPages[i].lastUsed < mPages[index].lastUsed) {
+                    index = i;
+                }
+            }
+        }
+        mPages[index].xoffset = mFbVar.xoffset;
+        mPages[index].yoffset = mFbVar.yoffset;
+        mPages[index].pending.SetFull();
+    }
+
+    Page &page = mPages[index];
+    page.lastUsed = mFrames;
+    mPageIndex = index;
+    mDamage = page.pending;
+    page.pending.Clear();
+}
+
+void ViewBase::ReadDirtyPages()
+{
+    struct vfb_dirty_pages dirty = {};
+    dirty.count = mDirtyBitmap.size() * 32;
+    dirty.bitmap = reinterpret_cast<uintptr_t>(mDirtyBitmap.data());
+
+    if (ioctl(mViewFd, VFB_IOCTL_GET_DIRTY_PAGES, &dirty) == -1) {
+        throw std::system_error(errno, std::generic_category(), "Failed to get dirty pages");
+    }
+
+    const uint64_t line_length = mFbFix.line_length;
+    const uint32_t bits = std::min<uint32_t>(dirty.count, mDirtyBitmap.size() * 32);
+
+    for (uint32_t w = 0 ; w < (bits + 31) / 32 ; w++) {
+        uint32_t word = mDirtyBitmap[w];
+        while (word) {
+            uint64_t mem_page = (w * 32) + __builtin_ctz(word);
+            word &= word - 1;
+
+            // Scanlines touched by the memory page
+            uint64_t y1 = (mem_page * mPageSize) / line_length;
+            uint64_t y2 = ((((mem_page + 1) * mPageSize) - 1) / line_length) + 1;
+            y2 = std::min<uint64_t>(y2, mFbVar.yres_virtual);
+            if (y1 < y2) {
+                AddDamage(0, uint32_t(y1), mFbVar.xres_virtual, uint32_t(y2 - y1));
             }
-            LOG("Read: ", bytes, ", should be: ", sizeof(mFbVar), ", yoffset: ", mFbVar.yoffset);
-            Resize(mFbVar.xres, mFbVar.yres);
-            Render();
         }
-        counts = ep.Wait(events, cMAX_EVENTS, 10);
     }
+
+    if (dirty.count > mDirtyBitmap.size() * 32) {
+        // Video memory grew, pages beyond the bitmap were not reported
+        mDirtyBitmap.resize((dirty.count + 31) / 32);
+        for (Page &page : mPages) {
+            page.pending.SetFull();
+        }
+    }
+}
+
+bool ViewBase::ReadScreenInfo(struct vfb_screeninfo &arInfo)
+{
+    if (!mDriverScreenInfo) {
+        return false;
+    }
+    if (ioctl(mViewFd, VFB_IOCTL_GET_SCREENINFO, &arInfo) == -1) {
+        if (errno != ENOTTY) {
+            throw std::system_error(errno, std::generic_category(), "Failed to get screen info");
+        }
+        mDriverScreenInfo = false;
+        return false;
+    }
+    return true;
 }
 
+bool ViewBase::ReadPalette()
+{
+    struct vfb_screeninfo info;
+    if (ReadScreenInfo(info)) {
+        struct fb_cmap cmap = { 0, 256, info.red, info.green, info.blue, nullptr };
+        return mConverter.SetPalette(cmap);
+    }
+
+    uint16_t red[256];
+    uint16_t green[256];
+    uint16_t blue[256];
+    struct fb_cmap cmap = { 0, 256, red, green, blue, nullptr };
+
+    if (ioctl(mFrameBufFd, FBIOGETCMAP, &cmap) == -1) {
+        throw std::system_error(errno, std::generic_category(), "Failed to get color map");
+    }
+    return mConverter.SetPalette(cmap);
+}
@@ -19,34 +19,83 @@
 #ifndef VIEWBASE_H_
 #define VIEWBASE_H_
 
+#include <atomic>
 #include <cstdint>
+#include <exception>
 #include <string>
+#include <vector>
 #include <linux/fb.h>
+#include "RowConverter.h"
+#include "Damage.h"
+#include "Scaler.h"
+#include "Rotator.h"
+#include "Epoll.h"
+#include "EventFd.h"
+#include "FrameQueue.h"
+#include "FrameScheduler.h"
+#include "StageTimer.h"
+#include "TileHasher.h"
+#include "driver/vfb2.h"
+
+/**
+ * \struct ViewOptions
+ * \brief Viewer settings given on the command line.
+ */
+struct ViewOptions
+{
+    /** Detect changed tiles by hashing, when the driver reports no damage */
+    bool tileHash = false;
+    /** Print the time spent in each stage of the render pipeline on exit */
+    bool statistics = false;
+    /** Maximum frames per second, 0 to use the refresh rate of the video mode */
+    double refreshRate = 0;
+    /** Scale the frame to the window on the CPU, the window is resizable unless None */
+    Scaler::Filter scaleFilter = Scaler::Filter::None;
+    /** Initial window size, in multiples of the frame size, when scaling */
+    unsigned zoom = 1;
+    /** Rotation of the frame buffer content, FB_ROTATE_*, -1 to use rotate of the video mode */
+    int rotate = -1;
+    /** Write frames to this file, pipe or FIFO instead of a window, "-" for stdout */
+    std::string outputPath;
+    /** Write a Y4M stream instead of raw RGBA frames */
+    bool y4m = false;
+    /** Write only every n-th presented frame */
+    unsigned decimation = 1;
+};
 
 /**
  * \class ViewBase
  * \brief Abstract interface class for implementing frame buffer viewers
  *
+ *        Rendering is split in two threads. A conversion thread waits for
+ *        notifications from the view device, works out the damage, and
+ *        converts the damaged areas into a Frame, at most once per refresh
+ *        interval. The thread calling run()
+ *        uploads and presents the latest frame. A slow Present() therefore
+ *        does not delay the conversion of the next frame, frames that were
+ *        never presented are skipped, and their damage is carried into the
+ *        next frame.
  */
 class ViewBase
 {
 public:
     /**
-     * \fn  ViewBase(const std::string, const std::string)
+     * \fn  ViewBase(const std::string, const std::string, const ViewOptions&)
      * \brief Constructor that opens the the framebuffer and the view notification device.
      *        The frame buffer is mmap'ed into the mpBuffer member variable.
      *
      *
      * \param aFrameBufferName E.g. /dev/fb0
      * \param aViewDeviceName E.g. /dev/fb_view
+     * \param aOptions Viewer settings
      */
-    ViewBase(const std::string aFrameBufferName, const std::string aViewDeviceName);
+    ViewBase(const std::string aFrameBufferName, const std::string aViewDeviceName, const ViewOptions &aOptions);
     virtual ~ViewBase();
 
     /**
      * \fn void run()
-     * \brief Application loop, polls the notification device for changes and
-     *        renders the output window.
+     * \brief Application loop, starts the conversion thread, and renders frames
+     *        in the output window as they are converted.
      */
     void run();
 
@@ -59,15 +108,33 @@ public:
     virtual bool PollEvents() = 0; // Return false to terminate
 
     /**
-     * \fn void Render()
-     * \brief Called whenever the frame buffer content has changed.
+     * \fn bool AddEventSources(Epoll&)
+     * \brief Add the file descriptors that become readable when PollEvents()
+     *        has something to handle.
      *
+     * \param arEpoll Epoll instance of the render thread
+     * \return false if events must be polled periodically instead
      */
-    virtual void Render() = 0;
+    virtual bool AddEventSources([[maybe_unused]] Epoll &arEpoll) { return false; }
+
+    /**
+     * \fn void Upload(const Frame&)
+     * \brief Called whenever the frame buffer content has changed, to copy the
+     *        damaged areas of the frame to the output.
+     *
+     * \param aFrame Owned by the render thread until the next call
+     */
+    virtual void Upload(const Frame &aFrame) = 0;
+
+    /**
+     * \fn void Present()
+     * \brief Called after Upload() to show the page of the frame in the window.
+     */
+    virtual void Present() = 0;
 
     /**
      * \fn void Resize(int, int)
-     * \brief Called before render to let an implementation change the size of the
+     * \brief Called before upload to let an implementation change the size of the
      *        output window in case frame buffer resolution has changed.
      *
      * \param aWidth in pixels
@@ -76,6 +143,215 @@ public:
     virtual void Resize(int aWidth, int aHeight) = 0;
 
 protected:
+    /**
+     * \fn void RequestRedraw()
+     * \brief Have every page converted in full for the next frame, e.g. when
+     *        the implementation has lost its output. Thread safe.
+     */
+    void RequestRedraw();
+
+    /**
+     * \fn void ConvertLoop()
+     * \brief Body of the conversion thread.
+     */
+    void ConvertLoop();
+
+    /**
+     * \fn bool ReadNotification()
+     * \brief Read a notification from the view device, and pass it to the scheduler.
+     *
+     * \return true if a frame should be converted now
+     */
+    bool ReadNotification();
+
+    /**
+     * \fn void ConvertFrame()
+     * \brief Publish the damaged areas of the visible page as a frame.
+     */
+    void ConvertFrame();
+
+    /**
+     * \fn void AcknowledgeFrame(const Frame&)
+     * \brief Tell the driver that the pan of a frame has been presented.
+     */
+    void AcknowledgeFrame(const Frame &aFrame);
+
+    /**
+     * \fn void PrintStatistics()
+     * \brief Print the time spent in each pipeline stage.
+     */
+    void PrintStatistics() const;
+
+    /**
+     * \fn void ReadViewDevice()
+     * \brief Read the screen info, and any damage reported by the driver, from the
+     *        view device. The damage is added to the pending damage of the
+     *        cached pages, until SelectPage() picks the page to convert.
+     */
+    void ReadViewDevice();
+
+    /**
+     * \fn void ReadLegacy()
+     * \brief Read the screen info, optionally followed by struct vfb_damage.
+     */
+    void ReadLegacy();
+
+    /**
+     * \fn void ReadEvents()
+     * \brief Read and process all queued struct vfb_event records.
+     */
+    void ReadEvents();
+
+    /**
+     * \fn void ReadRing()
+     * \brief Process all events in the shared event ring.
+     */
+    void ReadRing();
+
+    /**
+     * \fn void ProcessEvent(const struct vfb_event&, StageTimer::Clock::time_point)
+     * \brief Check the sequence number of an event, and process it.
+     *
+     * \param arEvent
+     * \param aNow Time the event was received
+     */
+    void ProcessEvent(const struct vfb_event &arEvent, StageTimer::Clock::time_point aNow);
+
+    /**
+     * \fn void ProcessNotification(const struct fb_var_screeninfo&, const struct vfb_damage&)
+     * \brief Update the screen info, and add the damage to the cached pages.
+     *
+     * \param aVar Screen info after the notification
+     * \param aDamage Damage since the previous notification
+     */
+    void ProcessNotification(const struct fb_var_screeninfo &aVar, const struct vfb_damage &aDamage);
+
+    /**
+     * \fn void ReadDirtyPages()
+     * \brief Fetch the pages written through mmap from the driver, and add the
+     *        scanlines they cover to the pending damage of the cached pages.
+     */
+    void ReadDirtyPages();
+
+    /**
+     * \fn bool ReadScreenInfo(struct vfb_screeninfo&)
+     * \brief Fetch the mode and color map from the view device. A pan waiting
+     *        for a flip acknowledgement holds the frame buffer lock, so the
+     *        ioctls of the frame buffer device would stall until it times out.
+     *
+     * \return false if the driver does not support it, the frame buffer device
+     *         is then used instead
+     */
+    bool ReadScreenInfo(struct vfb_screeninfo &arInfo);
+
+    /**
+     * \fn bool ReadPalette()
+     * \brief Read the color map of a pseudocolor frame buffer into the converter.
+     *
+     * \return true if any color changed
+     */
+    bool ReadPalette();
+
+    /**
+     * \fn void AddDamage(uint32_t, uint32_t, uint32_t, uint32_t)
+     * \brief Add a damaged rectangle, in virtual screen coordinates, to the
+     *        pending damage of every cached page it overlaps.
+     */
+    void AddDamage(uint32_t aX, uint32_t aY, uint32_t aWidth, uint32_t aHeight);
+
+    /**
+     * \fn void SelectPage()
+     * \brief Find or allocate the cached page for the current pan offsets, and
+     *        move its pending damage to mDamage.
+     */
+    void SelectPage();
+
+    /**
+     * \fn bool SameBitfield(const struct fb_bitfield&, const struct fb_bitfield&)
+     * \brief Compare the position of a color in two pixel layouts.
+     */
+    static bool SameBitfield(const struct fb_bitfield &arA, const struct fb_bitfield &arB);
+
+    /**
+     * \fn void RemapFrameBuffer()
+     * \brief Fetch the fixed screen info after a mode change, and map the
+     *        frame buffer and the snapshots again if the driver replaced them.
+     */
+    void RemapFrameBuffer();
+
+    /**
+     * \fn void ReleaseMappings()
+     * \brief Unmap frame buffer mappings replaced by a mode change, once the
+     *        render thread has uploaded a frame converted after it.
+     */
+    void ReleaseMappings();
+
+    /**
+     * \fn bool MapSnapshot()
+     * \brief Map the snapshots of the driver into mpSnapshot.
+     *
+     * \return false if the driver takes no snapshots
+     */
+    bool MapSnapshot();
+
+    /**
+     * \fn void ConfigureRotation()
+     * \brief Select the rotation from the options, or from the video mode.
+     */
+    void ConfigureRotation();
+
+    /**
+     * \fn void ConvertRotated(Frame&, const uint8_t*, const Damage::Rect&)
+     * \brief Convert an area of the visible page in bands of rows, and rotate
+     *        each band into the staging buffer while it is still in cache.
+     *
+     * \param arFrame Frame with its staging buffer allocated
+     * \param apSrc Address of the first frame buffer pixel of the area
+     * \param arRect The area, in page coordinates
+     */
+    void ConvertRotated(Frame &arFrame, const uint8_t *apSrc, const Damage::Rect &arRect);
+
+    /**
+     * \fn const struct vfb_snapshot_slot* FindSnapshot(uint32_t&)
+     * \brief Find the newest snapshot of a pan not later than the one shown,
+     *        taken in the current video mode.
+     *
+     * \param arSeq Output: seq of the slot, to pass to SnapshotValid()
+     * \return The slot, or nullptr to convert from the live frame buffer
+     */
+    const struct vfb_snapshot_slot* FindSnapshot(uint32_t &arSeq) const;
+
+    /**
+     * \fn bool SnapshotValid(const struct vfb_snapshot_slot&, uint32_t)
+     * \brief Check that a slot was not reused while it was read.
+     *
+     * \param arSlot
+     * \param aSeq Value returned by FindSnapshot()
+     */
+    bool SnapshotValid(const struct vfb_snapshot_slot &arSlot, uint32_t aSeq) const;
+
+    /**
+     * \fn const uint8_t* GetVisiblePage()
+     * \brief Address of the first visible pixel in the frame buffer.
+     */
+    const uint8_t* GetVisiblePage() const;
+
+    /**
+     * \fn uint32_t GetWrapRow()
+     * \brief Number of visible rows before the end of the virtual screen.
+     *        With FB_VMODE_YWRAP the remaining rows are at the top of the
+     *        virtual screen, see GetWrappedPage(). yres if the page does not wrap.
+     */
+    uint32_t GetWrapRow() const;
+
+    /**
+     * \fn const uint8_t* GetWrappedPage()
+     * \brief Address of the first visible pixel in the top row of the virtual screen.
+     */
+    const uint8_t* GetWrappedPage() const;
+
+    ViewOptions mOptions;
+
     int mViewFd;
     int mFrameBufFd;
 
@@ -83,6 +359,114 @@ protected:
 
     struct fb_fix_screeninfo mFbFix;
     struct fb_var_screeninfo mFbVar;
+
+    RowConverter mConverter;
+    Rotator mRotator;
+    /** Converted rows waiting to be rotated */
+    std::vector<uint32_t> mBand;
+
+    /** Areas of the visible page to convert into the next frame */
+    Damage mDamage;
+    /** Driver appends damage rectangles to the screen info */
+    bool mDriverDamage = true;
+    /** Driver tracks pages written through mmap, so pans do not imply full redraws */
+    bool mDirtyPages = false;
+    uint32_t mPageSize = 0;
+    std::vector<uint32_t> mDirtyBitmap;
+    /** Sequence number of the last pan read from the driver */
+    uint32_t mPanSeq = 0;
+    /** Driver supports VFB_IOCTL_ACK_FLIP, only used by the render thread */
+    bool mFlipAck = true;
+    /** Driver supports VFB_IOCTL_GET_SCREENINFO */
+    bool mDriverScreenInfo = true;
+    /** smem_seq of the mapped video memory */
+    uint32_t mSmemSeq = 0;
+    /** Driver returns struct vfb_event records */
+    bool mEventProtocol = false;
+    struct vfb_event mEventBuffer[16];
+    /** Shared event ring, when the driver supports it */
+    struct vfb_ring *mpRing = nullptr;
+    /**
+     * \struct RetiredMapping
+     * \brief A mapping of video memory the driver has replaced, which frames
+     *        up to lastFrame may still refer to.
+     */
+    struct RetiredMapping {
+        void *pAddress;
+        size_t size;
+        uint64_t lastFrame;
+    };
+    std::vector<RetiredMapping> mRetiredMappings;
+    /** Sequence of the last frame uploaded by the render thread */
+    std::atomic<uint64_t> mUploadedFrame { 0 };
+
+    /** Copies of the visible page taken by the driver at pans, when it supports it */
+    struct vfb_snapshot *mpSnapshot = nullptr;
+    size_t mSnapshotSize = 0;
+    /** Pan of the copy the current page was last converted from */
+    uint32_t mSnapshotPanSeq = 0;
+    /** Frames dropped because their copy was overwritten during conversion */
+    uint64_t mTornSnapshots = 0;
+    /** Sequence number of the last event read */
+    uint64_t mEventSeq = 0;
+    uint64_t mLostEvents = 0;
+
+    /**
+     * \struct Page
+     * \brief A page of the virtual screen, as last rendered by the implementation.
+     *        Implementations caching more than one page, e.g. one texture per
+     *        page, use the index in mPages to find the cache entry.
+     */
+    struct Page {
+        uint32_t xoffset = 0;
+        uint32_t yoffset = 0;
+        /** Damage since the page was last rendered, in page coordinates */
+        Damage pending;
+        /** Tile hashes of the page as last rendered */
+        TileHasher hasher;
+        uint64_t lastUsed = 0;
+    };
+
+    std::vector<Page> mPages;
+    /** Index in mPages of the page to render */
+    size_t mPageIndex = 0;
+    /** Number of pages the implementation can cache */
+    size_t mMaxPages = 1;
+    uint64_t mFrames = 0;
+
+    TileHasher::Statistics mTileStatistics;
+
+    /** Frames from the conversion thread to the render thread */
+    FrameQueue mQueue;
+    /** Signaled when a frame is published */
+    EventFd mFrameReady;
+    /** Signaled when the conversion thread must exit */
+    EventFd mStop;
+    /** Signaled by RequestRedraw() */
+    EventFd mRedraw;
+    /** Pixels around each damaged area the implementation reads too, e.g. to filter */
+    uint32_t mDamageMargin = 0;
+    /** Registered with VFB_IOCTL_SET_EVENTFD, replaces polling mViewFd */
+    EventFd mViewEvent;
+    FrameScheduler mScheduler;
+    /** When the last notification was read */
+    StageTimer::Clock::time_point mReadTime;
+    std::atomic<bool> mRunning { false };
+    /** Exception thrown by the conversion thread, rethrown by run() */
+    std::exception_ptr mConvertError;
+
+    /** Conversion thread stages */
+    StageTimer mEventTimer { "event" };
+    StageTimer mReadTimer { "read" };
+    StageTimer mHashTimer { "hash" };
+    StageTimer mConvertTimer { "convert" };
+    uint64_t mDroppedFrames = 0;
+    /** Render thread stages */
+    StageTimer mQueueTimer { "queued" };
+    StageTimer mUploadTimer { "upload" };
+    StageTimer mPresentTimer { "present" };
+    /** From the pan in the producer to the acknowledgement after present */
+    StageTimer mFlipTimer { "pan2ack" };
 };
 
 #endif /* VIEWBASE_H_ */
@@ -16,6 +16,32 @@
  *  a user application to get notified whenever panning is performed.
  *  Reading from the file always returns the content of struct fb_var_screeninfo,
  *  which contains the yoffset parameter used to control double buffering.
+ *  If the read buffer is large enough, the screen info is followed by the list
+ *  of areas damaged since the previous read, see vfb2.h.
+ *
+ *  With the deferred_io module parameter, pages written through mmap are
+ *  tracked using fbdev deferred I/O, and can be fetched with an ioctl.
+ *
+ *  A hrtimer generates a virtual vertical blank at the refresh rate of the
+ *  current mode, which producers can wait for with FBIO_WAITFORVSYNC. It only
+ *  runs while something waits for a vertical blank. With
+ *  the pan_at_vblank module parameter, pans are latched and only shown to the
+ *  viewer at the next vertical blank, like a page flip on real hardware.
+ *
+ *  With the flip_ack module parameter, a pan blocks until the viewer has
+ *  presented it, giving the producer back-pressure from the viewer. Only
+ *  viewers that acknowledge pans hold them back.
+ *
+ *  Readers using the event protocol can mmap a ring of events, and only need
+ *  to poll when the ring is empty.
+ *
+ *  The instances module parameter creates several frame buffers, each with
+ *  its own video memory, mode_option entry and view node: /dev/fb_view for
+ *  the first, /dev/fb_view1, /dev/fb_view2 and so on for the others.
+ *
+ *  Every open file of /dev/fb_view collects its own damage, dirty pages and
+ *  events, so a viewer, a recorder and other consumers can read at the same
+ *  time without taking notifications from each other.
  *
  *  The emul_fb application is designed to show the content from this frame buffer
  *  in a native desktop window. This way it is possible to test gui frameworks
@@ -42,28 +68,74 @@
 #include <linux/fs.h>
 #include <linux/uaccess.h>
 #include <linux/version.h>
+#include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/atomic.h>
+#include <linux/bitmap.h>
+#include <linux/slab.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/eventfd.h>
+#include <linux/rwsem.h>
+
+#include "vfb2.h"
 
 /*#define PRINT(a, ...) pr_info(a, ##__VA_ARGS__)
  */
 #define PRINT(a, ...)
 
     /*
-     *  RAM we reserve for the frame buffer. This defines the maximum screen
-     *  size
+     *  Maximum RAM for a frame buffer. Only what the current mode needs is
+     *  allocated, this defines the maximum screen size
      *
      *  The default can be overridden if the driver is compiled as a module
      */
 
-#define VIDEOMEMSIZE    (16 * 1024 * 1024)   /* 16 MB */
+#define VIDEOMEMSIZE    (128 * 1024 * 1024)  /* 128 MB */
 
-static void *videomemory;
 static u_long videomemorysize = VIDEOMEMSIZE;
 module_param(videomemorysize, ulong, 0);
-MODULE_PARM_DESC(videomemorysize, " RAM available to frame buffer (in bytes). Defaults to 16MB");
+MODULE_PARM_DESC(videomemorysize, " Maximum RAM for each frame buffer (in bytes), only the current mode is allocated. Defaults to 128MB");
+
+static bool deferred_io = false;
+module_param(deferred_io, bool, 0);
+MODULE_PARM_DESC(deferred_io, " Track pages written through mmap (costs a page fault per page per flush). Defaults to off");
+
+static uint deferred_io_delay = 10;
+module_param(deferred_io_delay, uint, 0);
+MODULE_PARM_DESC(deferred_io_delay, " Milliseconds from first write to a page until it is reported dirty. Defaults to 10");
+
+/* Deferred I/O memory can not be reallocated, so it is allocated at probe */
+static u_long deferred_io_memorysize = 16 * 1024 * 1024;
+module_param(deferred_io_memorysize, ulong, 0);
+MODULE_PARM_DESC(deferred_io_memorysize, " RAM allocated for each frame buffer with deferred_io, limiting the screen size (in bytes). Defaults to 16MB");
+
+static bool pan_at_vblank = false;
+module_param(pan_at_vblank, bool, 0);
+MODULE_PARM_DESC(pan_at_vblank, " Show pans to the viewer at the next virtual vertical blank. Defaults to off");
+
+static bool flip_ack = false;
+module_param(flip_ack, bool, 0);
+MODULE_PARM_DESC(flip_ack, " Block pans until the viewer has presented them. Defaults to off");
+
+static uint flip_ack_timeout = 100;
+module_param(flip_ack_timeout, uint, 0);
+MODULE_PARM_DESC(flip_ack_timeout, " Milliseconds a pan waits for the viewer with flip_ack. Defaults to 100");
+
+static uint snapshot = 0;
+module_param(snapshot, uint, 0);
+MODULE_PARM_DESC(snapshot, " Number of copies of the visible page taken at pans (0-4). Defaults to 0 (off)");
+
+#define VFB_MAX_INSTANCES   8
 
-static char *mode_option = NULL;
-module_param(mode_option, charp, 0);
-MODULE_PARM_DESC(mode_option, "Preferred video mode (e.g. 480x800-32@60)");
+static uint instances = 1;
+module_param(instances, uint, 0);
+MODULE_PARM_DESC(instances, " Number of frame buffers, each with its own video memory and /dev/fb_view node (1-8). Defaults to 1");
+
+static char *mode_option[VFB_MAX_INSTANCES];
+static int mode_option_count;
+module_param_array(mode_option, charp, &mode_option_count, 0);
+MODULE_PARM_DESC(mode_option, "Preferred video mode of each frame buffer, comma separated (e.g. 480x800-32@60,800x480-16@60)");
 
 static const struct fb_videomode vfb_default = {
     .xres =     480,
@@ -93,21 +165,34 @@ static int vfb_check_var(struct fb_var_screeninfo *var,
 static int vfb_set_par(struct fb_info *info);
 static int vfb_setcolreg(u_int regno, u_int red, u_int green, u_int blue,
              u_int transp, struct fb_info *info);
+static int vfb_setcmap(struct fb_cmap *cmap, struct fb_info *info);
 static int vfb_pan_display(struct fb_var_screeninfo *var,
                struct fb_info *info);
 static int vfb_mmap(struct fb_info *info,
             struct vm_area_struct *vma);
+static int vfb_ioctl(struct fb_info *info, unsigned int cmd,
+             unsigned long arg);
+static ssize_t vfb_write(struct fb_info *info, const char __user *buf,
+             size_t count, loff_t *ppos);
+static void vfb_fillrect(struct fb_info *info, const struct fb_fillrect *rect);
+static void vfb_copyarea(struct fb_info *info, const struct fb_copyarea *area);
+static void vfb_imageblit(struct fb_info *info, const struct fb_image *image);
+
+static ssize_t vfb_read(struct fb_info *info, char __user *buf,
+             size_t count, loff_t *ppos);
 
 static const struct fb_ops vfb_ops = {
-    .fb_read        = fb_sys_read,
-    .fb_write       = fb_sys_write,
+    .fb_read        = vfb_read,
+    .fb_write       = vfb_write,
     .fb_check_var   = vfb_check_var,
     .fb_set_par = vfb_set_par,
     .fb_setcolreg   = vfb_setcolreg,
+    .fb_setcmap     = vfb_setcmap,
     .fb_pan_display = vfb_pan_display,
-    .fb_fillrect    = sys_fillrect,
-    .fb_copyarea    = sys_copyarea,
-    .fb_imageblit   = sys_imageblit,
+    .fb_fillrect    = vfb_fillrect,
+    .fb_copyarea    = vfb_copyarea,
+    .fb_imageblit   = vfb_imageblit,
+    .fb_ioctl       = vfb_ioctl,
     .fb_mmap        = vfb_mmap
 };
 
@@ -115,17 +200,109 @@ static const struct fb_ops vfb_ops = {
 
 static int majorNumber;
 static struct class*  viewClass  = NULL;
-static struct device* viewDevice = NULL;
 
-static DECLARE_WAIT_QUEUE_HEAD(pan_wait);
-static int panned = 0;
-static struct fb_var_screeninfo *fb_var_info;
-static struct mutex view_mutex;
+/* Offsets shown to the viewer, and a pan waiting for the next vertical blank */
+struct vfb_scanout {
+    u32 xoffset;
+    u32 yoffset;
+    u32 ywrap;
+    u32 seq;
+};
+
+/*
+ *  State of a frame buffer instance, in info->par. Each instance has its own
+ *  video memory, vertical blank and /dev/fb_view node.
+ */
+struct vfb_par {
+    struct fb_info *info;
+    void *videomemory;
+    size_t videomemory_size;
+    /* Held for reading while read() and write() access video memory, which
+     * is replaced when a mode needs a different size */
+    struct rw_semaphore memory_sem;
+    int instance;
+    struct device *view_device;
+
+    wait_queue_head_t pan_wait;
+
+    /* Drawing operations may be called from atomic context, so damage has its own spinlock */
+    spinlock_t damage_lock;
+
+    /* Pages in video memory, when pages written through mmap are tracked with deferred_io */
+    u32 dirty_pages_count;
+#ifdef CONFIG_FB_DEFERRED_IO
+    struct fb_deferred_io defio;
+#endif
+
+    /* Virtual vertical blank */
+    struct hrtimer vblank_timer;
+    ktime_t vblank_period;
+    unsigned long vblank_count;
+    wait_queue_head_t vblank_wait;
+    /* Protected by damage_lock. The timer stops once nothing needs it */
+    bool vblank_armed;
+    u32 vblank_waiters;
+
+    /*
+     *  Written with damage_lock held. scanout and the offsets in info->var
+     *  are also published through scanout_lock, so readers can take a
+     *  consistent snapshot without blocking a pan.
+     */
+    seqlock_t scanout_lock;
+    struct vfb_scanout scanout;
+    struct vfb_scanout pending_pan;
+    bool pan_pending;
+
+    /* Pan sequence numbers, and the last pan presented by the viewer. Protected by damage_lock */
+    u32 pan_seq;
+    ktime_t pan_time;
+    u32 acked_seq;
+    wait_queue_head_t ack_wait;
+    /* Open files that have acknowledged a pan, only these hold pans back */
+    atomic_t ack_viewers;
+
+    /* Mode and color map for VFB_IOCTL_GET_SCREENINFO, protected by damage_lock */
+    struct vfb_screeninfo screeninfo;
+
+    /* Open files of /dev/fb_view, protected by damage_lock */
+    struct list_head readers;
+
+    /* Copies of the visible page taken at pans, written only by vfb_pan_display */
+    struct vfb_snapshot *snapshot;
+    size_t snapshot_size;
+    size_t snapshot_slot_size;
+
+    u32 pseudo_palette[256];
+};
+
+/* Instances by minor number of their /dev/fb_view node */
+static struct vfb_par *vfb_instances[VFB_MAX_INSTANCES];
+
+/* State of an open /dev/fb_view file. Protected by damage_lock of the instance */
+#define VFB_EVENT_QUEUE_LEN 32
+struct vfb_reader {
+    struct list_head list;
+    struct vfb_par *par;
+    u32 protocol;                   /* Format returned by dev_read, see VFB_IOCTL_SET_PROTOCOL */
+    struct vfb_damage damage;       /* Collected since the previous read or event */
+    unsigned long *dirty_pages;     /* Written through mmap, only used with deferred_io */
+    struct vfb_event event_queue[VFB_EVENT_QUEUE_LEN];    /* Waiting to be read */
+    u32 event_head;
+    u32 event_count;
+    u64 event_seq;
+    struct vfb_ring *ring;          /* Replaces event_queue once mmap'ed */
+    u32 ring_head;                  /* Own copy, ring->head can be written by the reader */
+    bool ring_overflow;
+    struct eventfd_ctx *eventfd;    /* Signalled on changes, see VFB_IOCTL_SET_EVENTFD */
+    bool acking;                    /* Has used VFB_IOCTL_ACK_FLIP, counted in ack_viewers */
+};
 
 static int     dev_open(struct inode *, struct file *);
 static int     dev_release(struct inode *, struct file *);
 static ssize_t dev_read(struct file *, char *, size_t, loff_t *);
 static unsigned int dev_poll(struct file *file, poll_table *wait);
+static long    dev_ioctl(struct file *, unsigned int, unsigned long);
+static int     dev_mmap(struct file *, struct vm_area_struct *);
 
 static struct file_operations fops =
 {
@@ -133,7 +310,10 @@ static struct file_operations fops =
     .open = dev_open,
     .read = dev_read,
     .release = dev_release,
-    .poll = dev_poll
+    .poll = dev_poll,
+    .unlocked_ioctl = dev_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .mmap = dev_mmap
 };
 
     /*
@@ -150,6 +330,650 @@ static u_long get_line_length(int xres_virtual, int bpp)
     return (length);
 }
 
+    /*
+     *  Damage tracking
+     */
+
+static int rect_touches(const struct vfb_rect *a, const struct vfb_rect *b)
+{
+    return (a->x <= b->x + b->width) && (b->x <= a->x + a->width) &&
+           (a->y <= b->y + b->height) && (b->y <= a->y + a->height);
+}
+
+static void rect_union(struct vfb_rect *a, const struct vfb_rect *b)
+{
+    u32 x2 = max(a->x + a->width, b->x + b->width);
+    u32 y2 = max(a->y + a->height, b->y + b->height);
+
+    a->x = min(a->x, b->x);
+    a->y = min(a->y, b->y);
+    a->width = x2 - a->x;
+    a->height = y2 - a->y;
+}
+
+/*
+ *  Add a rectangle to the damage list of a reader. Rectangles touching an
+ *  existing entry are merged with it. When the list is full everything is
+ *  marked as damaged.
+ *  Called with damage_lock held.
+ */
+static void vfb_reader_damage(struct vfb_damage *damage, const struct vfb_rect *r)
+{
+    u32 i;
+
+    if (damage->flags & VFB_DAMAGE_FULL)
+        return;
+
+    for (i = 0; i < damage->count; i++) {
+        if (rect_touches(&damage->rects[i], r)) {
+            rect_union(&damage->rects[i], r);
+            return;
+        }
+    }
+    if (damage->count < VFB_MAX_DAMAGE_RECTS) {
+        damage->rects[damage->count++] = *r;
+    } else {
+        damage->flags |= VFB_DAMAGE_FULL;
+        damage->count = 0;
+    }
+}
+
+/*
+ *  Signal the eventfd registered by a reader, if any.
+ *  Called with damage_lock held.
+ */
+static void vfb_signal(struct vfb_reader *reader)
+{
+    if (!reader->eventfd)
+        return;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+    eventfd_signal(reader->eventfd);
+#else
+    eventfd_signal(reader->eventfd, 1);
+#endif
+}
+
+static void vfb_ring_push(struct vfb_reader *reader);
+static void vfb_vblank_arm(struct vfb_par *par);
+
+static void vfb_damage_rect(struct vfb_par *par, u32 x, u32 y, u32 width, u32 height)
+{
+    struct vfb_rect r = { .x = x, .y = y, .width = width, .height = height };
+    struct vfb_reader *reader;
+    unsigned long flags;
+
+    if (!width || !height)
+        return;
+
+    spin_lock_irqsave(&par->damage_lock, flags);
+    list_for_each_entry(reader, &par->readers, list) {
+        /* One signal per batch of drawing, until the damage is read */
+        bool signal = !reader->damage.count && !(reader->damage.flags & VFB_DAMAGE_FULL);
+
+        vfb_reader_damage(&reader->damage, &r);
+        if (reader->ring && reader->eventfd)
+            vfb_ring_push(reader);
+        else if (signal)
+            vfb_signal(reader);
+    }
+    spin_unlock_irqrestore(&par->damage_lock, flags);
+
+    wake_up_interruptible_all(&par->pan_wait);
+}
+
+/*
+ *  Check without locking if a reader has something to read. Only used by
+ *  poll, which has registered on pan_wait before calling this, so a change
+ *  missed by the check still wakes the poller.
+ */
+static int vfb_damage_pending(struct vfb_reader *reader)
+{
+    if (READ_ONCE(reader->damage.count) || READ_ONCE(reader->damage.flags) ||
+        READ_ONCE(reader->event_count))
+        return 1;
+    if (reader->dirty_pages)
+        return !bitmap_empty(reader->dirty_pages, reader->par->dirty_pages_count);
+    return 0;
+}
+
+/*
+ *  Queue an event with the current offsets for a reader, and move the damage
+ *  collected so far into it. When the queue is full the newest event is
+ *  replaced, and the lost damage is covered by marking everything as damaged.
+ *  When the shared ring is full the event is dropped instead, as the reader
+ *  may be reading the newest entry.
+ *  Called with damage_lock held.
+ */
+static void vfb_queue_event(struct vfb_reader *reader, u32 flags)
+{
+    struct vfb_par *par = reader->par;
+    struct vfb_damage *damage = &reader->damage;
+    struct vfb_event *ev;
+
+    if (reader->ring) {
+        if (reader->ring_head - smp_load_acquire(&reader->ring->tail) >= VFB_RING_LEN) {
+            reader->event_seq++;
+            reader->ring_overflow = true;
+            damage->flags |= VFB_DAMAGE_FULL;
+            damage->count = 0;
+            return;
+        }
+        ev = &reader->ring->events[reader->ring_head % VFB_RING_LEN];
+        if (reader->ring_overflow) {
+            flags |= VFB_EVENT_OVERFLOW | VFB_EVENT_DAMAGE_FULL;
+            reader->ring_overflow = false;
+        }
+    } else if (reader->event_count == VFB_EVENT_QUEUE_LEN) {
+        ev = &reader->event_queue[(reader->event_head + reader->event_count - 1) % VFB_EVENT_QUEUE_LEN];
+        flags |= ev->flags | VFB_EVENT_OVERFLOW | VFB_EVENT_DAMAGE_FULL;
+    } else {
+        ev = &reader->event_queue[(reader->event_head + reader->event_count) % VFB_EVENT_QUEUE_LEN];
+        reader->event_count++;
+    }
+
+    memset(ev, 0, sizeof(*ev));
+    ev->version = VFB_EVENT_VERSION;
+    ev->size = sizeof(*ev);
+    ev->seq = ++reader->event_seq;
+    ev->timestamp_ns = ktime_get_ns();
+    ev->xoffset = par->scanout.xoffset;
+    ev->yoffset = par->scanout.yoffset;
+    ev->vmode = par->info->var.vmode & ~FB_VMODE_YWRAP;
+    if (par->scanout.ywrap)
+        ev->vmode |= FB_VMODE_YWRAP;
+    ev->pan_seq = par->scanout.seq;
+
+    if (damage->flags & VFB_DAMAGE_FULL) {
+        flags |= VFB_EVENT_DAMAGE_FULL;
+    } else if (!(flags & VFB_EVENT_DAMAGE_FULL)) {
+        memcpy(ev->rects, damage->rects, damage->count * sizeof(struct vfb_rect));
+        ev->damage_count = damage->count;
+    }
+    ev->flags = flags;
+
+    damage->flags = 0;
+    damage->count = 0;
+
+    if (reader->ring)
+        smp_store_release(&reader->ring->head, ++reader->ring_head);
+}
+
+/*
+ *  Move damage not yet attached to an event into the shared ring of a
+ *  reader, and check if the ring holds events.
+ */
+static int vfb_ring_flush(struct vfb_reader *reader)
+{
+    struct vfb_par *par = reader->par;
+    unsigned long flags;
+    u32 tail;
+    int ret;
+
+    spin_lock_irqsave(&par->damage_lock, flags);
+    tail = smp_load_acquire(&reader->ring->tail);
+    if (reader->ring_head - tail < VFB_RING_LEN) {
+        /* Also wake the reader for pages written through mmap */
+        if (reader->damage.count || reader->damage.flags ||
+            (reader->ring_head == tail && reader->dirty_pages &&
+             !bitmap_empty(reader->dirty_pages, par->dirty_pages_count)))
+            vfb_queue_event(reader, 0);
+    }
+    ret = reader->ring_head != tail;
+    spin_unlock_irqrestore(&par->damage_lock, flags);
+
+    return ret;
+}
+
+/*
+ *  A reader with a shared ring and an eventfd neither polls nor reads, so
+ *  damage is moved into its ring before it is signalled. So drawing does not
+ *  flood the ring, this is only done once the reader has taken every event,
+ *  and damage collected meanwhile waits for the next vertical blank.
+ *  Called with damage_lock held.
+ */
+static void vfb_ring_push(struct vfb_reader *reader)
+{
+    if (reader->ring_head != smp_load_acquire(&reader->ring->tail)) {
+        if (reader->damage.count || reader->damage.flags)
+            vfb_vblank_arm(reader->par);
+        return;
+    }
+    vfb_queue_event(reader, 0);
+    vfb_signal(reader);
+}
+
+/*
+ *  Report a change to every reader, as an event with the event protocol, or
+ *  as damage flags in the legacy format.
+ *  Called with damage_lock held.
+ */
+static void vfb_report(struct vfb_par *par, u32 event_flags, u32 damage_flags)
+{
+    struct vfb_reader *reader;
+
+    list_for_each_entry(reader, &par->readers, list) {
+        if (reader->protocol >= 1)
+            vfb_queue_event(reader, event_flags);
+        else
+            reader->damage.flags |= damage_flags;
+        vfb_signal(reader);
+    }
+}
+
+/*
+ *  Report a change of the offsets shown to the viewer.
+ *  Called with damage_lock held.
+ */
+static void vfb_report_pan(struct vfb_par *par)
+{
+    vfb_report(par, VFB_EVENT_PAN, VFB_DAMAGE_PANNED);
+}
+
+    /*
+     *  Virtual vertical blank
+     */
+
+/*
+ *  Frame time of a mode, from the pixel clock and the margins. Modes without
+ *  timings refresh at 60 Hz, and no mode refreshes faster than 1000 Hz, so
+ *  bogus timings can not flood the CPU with timer interrupts.
+ */
+static void vfb_set_vblank_period(struct vfb_par *par, const struct fb_var_screeninfo *var)
+{
+    u64 htotal = (u64)var->left_margin + var->xres + var->right_margin + var->hsync_len;
+    u64 vtotal = (u64)var->upper_margin + var->yres + var->lower_margin + var->vsync_len;
+    u64 ns;
+
+    /* Interlaced modes refresh one field, i.e. half the lines, per vertical blank */
+    if (var->vmode & FB_VMODE_INTERLACED)
+        vtotal /= 2;
+    if (var->vmode & FB_VMODE_DOUBLE)
+        vtotal *= 2;
+
+    /* pixclock is the pixel period in picoseconds */
+    ns = div_u64((u64)var->pixclock * htotal * vtotal, 1000);
+    if (!ns)
+        ns = NSEC_PER_SEC / 60;
+    else if (ns < NSEC_PER_MSEC)
+        ns = NSEC_PER_MSEC;
+
+    WRITE_ONCE(par->vblank_period, ns_to_ktime(ns));
+}
+
+/*
+ *  Start the vertical blank timer, for a waiter, a latched pan or damage
+ *  waiting for a ring.
+ *  Called with damage_lock held.
+ */
+static void vfb_vblank_arm(struct vfb_par *par)
+{
+    if (par->vblank_armed)
+        return;
+    par->vblank_armed = true;
+    hrtimer_start(&par->vblank_timer, READ_ONCE(par->vblank_period), HRTIMER_MODE_REL);
+}
+
+static enum hrtimer_restart vfb_vblank(struct hrtimer *timer)
+{
+    struct vfb_par *par = container_of(timer, struct vfb_par, vblank_timer);
+    struct vfb_reader *reader;
+    unsigned long flags;
+    bool busy;
+
+    spin_lock_irqsave(&par->damage_lock, flags);
+    /* Producers waiting now likely wait again next frame, so keep the phase */
+    busy = par->vblank_waiters > 0;
+    if (par->pan_pending) {
+        write_seqlock(&par->scanout_lock);
+        par->scanout = par->pending_pan;
+        write_sequnlock(&par->scanout_lock);
+        par->pan_pending = false;
+        vfb_report_pan(par);
+        busy = true;
+    }
+    list_for_each_entry(reader, &par->readers, list) {
+        if (reader->ring && reader->eventfd &&
+            (reader->damage.count || reader->damage.flags)) {
+            vfb_queue_event(reader, 0);
+            vfb_signal(reader);
+            busy = true;
+        }
+    }
+    WRITE_ONCE(par->vblank_count, par->vblank_count + 1);
+    if (!busy)
+        par->vblank_armed = false;
+    spin_unlock_irqrestore(&par->damage_lock, flags);
+
+    wake_up_interruptible_all(&par->vblank_wait);
+    if (!busy)
+        return HRTIMER_NORESTART;
+
+    wake_up_interruptible_all(&par->pan_wait);
+    hrtimer_forward_now(timer, READ_ONCE(par->vblank_period));
+    return HRTIMER_RESTART;
+}
+
+static int vfb_wait_for_vblank(struct vfb_par *par)
+{
+    unsigned long count;
+    unsigned long timeout;
+    long ret;
+
+    spin_lock_irq(&par->damage_lock);
+    count = par->vblank_count;
+    par->vblank_waiters++;
+    vfb_vblank_arm(par);
+    spin_unlock_irq(&par->damage_lock);
+
+    /* Two frames, and some slack for timer latency */
+    timeout = nsecs_to_jiffies(2 * ktime_to_ns(READ_ONCE(par->vblank_period))) + msecs_to_jiffies(20);
+    ret = wait_event_interruptible_timeout(par->vblank_wait,
+            READ_ONCE(par->vblank_count) != count, timeout);
+
+    spin_lock_irq(&par->damage_lock);
+    par->vblank_waiters--;
+    spin_unlock_irq(&par->damage_lock);
+
+    if (ret < 0)
+        return ret;
+    if (ret == 0)
+        return -ETIMEDOUT;
+    return 0;
+}
+
+static int vfb_ioctl(struct fb_info *info, unsigned int cmd,
+             unsigned long arg)
+{
+    u32 crtc;
+
+    switch (cmd) {
+    case FBIO_WAITFORVSYNC:
+        if (get_user(crtc, (u32 __user *)arg))
+            return -EFAULT;
+        if (crtc != 0)
+            return -ENODEV;
+        return vfb_wait_for_vblank(info->par);
+    default:
+        return -ENOTTY;
+    }
+}
+
+    /*
+     *  Flip acknowledgement
+     */
+
+static void vfb_wait_for_ack(struct vfb_par *par, u32 seq)
+{
+    long ret;
+
+    ret = wait_event_interruptible_timeout(par->ack_wait,
+            (s32)(READ_ONCE(par->acked_seq) - seq) >= 0,
+            msecs_to_jiffies(flip_ack_timeout));
+    if (ret == 0)
+        PRINT("Pan %u not presented within %u ms\n", seq, flip_ack_timeout);
+}
+
+static long vfb_ack_flip(struct vfb_reader *reader, struct vfb_flip_ack __user *arg)
+{
+    struct vfb_par *par = reader->par;
+    struct vfb_flip_ack ack;
+
+    if (copy_from_user(&ack, arg, sizeof(ack)))
+        return -EFAULT;
+
+    spin_lock_irq(&par->damage_lock);
+    if ((s32)(ack.seq - par->pan_seq) > 0) {
+        spin_unlock_irq(&par->damage_lock);
+        return -EINVAL;
+    }
+    if ((s32)(ack.seq - par->acked_seq) > 0)
+        par->acked_seq = ack.seq;
+    /* The first acknowledgement opts the file in to holding pans back */
+    if (!reader->acking) {
+        reader->acking = true;
+        atomic_inc(&par->ack_viewers);
+    }
+    ack.latency_ns = 0;
+    if (ack.seq == par->pan_seq)
+        ack.latency_ns = ktime_to_ns(ktime_sub(ktime_get(), par->pan_time));
+    spin_unlock_irq(&par->damage_lock);
+
+    wake_up_interruptible_all(&par->ack_wait);
+
+    if (copy_to_user(arg, &ack, sizeof(ack)))
+        return -EFAULT;
+
+    return 0;
+}
+
+static ssize_t vfb_read(struct fb_info *info, char __user *buf,
+             size_t count, loff_t *ppos)
+{
+    struct vfb_par *par = info->par;
+    ssize_t ret;
+
+    down_read(&par->memory_sem);
+    ret = fb_sys_read(info, buf, count, ppos);
+    up_read(&par->memory_sem);
+
+    return ret;
+}
+
+static ssize_t vfb_write(struct fb_info *info, const char __user *buf,
+             size_t count, loff_t *ppos)
+{
+    struct vfb_par *par = info->par;
+    loff_t pos = *ppos;
+    u32 line_length = info->fix.line_length;
+    u32 bytes_pp = info->var.bits_per_pixel / 8;
+    ssize_t ret;
+    u32 y1, y2;
+
+    down_read(&par->memory_sem);
+    ret = fb_sys_write(info, buf, count, ppos);
+    up_read(&par->memory_sem);
+    if (ret <= 0 || !line_length)
+        return ret;
+
+    /* Convert the written byte range to full or partial scanlines */
+    y1 = div_u64(pos, line_length);
+    y2 = div_u64(pos + ret - 1, line_length);
+    if (y1 == y2 && bytes_pp) {
+        u32 x1 = (u32)(pos - (u64)y1 * line_length) / bytes_pp;
+        u32 x2 = (u32)(pos + ret - 1 - (u64)y1 * line_length) / bytes_pp;
+        vfb_damage_rect(info->par, x1, y1, x2 - x1 + 1, 1);
+    } else {
+        vfb_damage_rect(info->par, 0, y1, info->var.xres_virtual, y2 - y1 + 1);
+    }
+
+    return ret;
+}
+
+static void vfb_fillrect(struct fb_info *info, const struct fb_fillrect *rect)
+{
+    sys_fillrect(info, rect);
+    vfb_damage_rect(info->par, rect->dx, rect->dy, rect->width, rect->height);
+}
+
+static void vfb_copyarea(struct fb_info *info, const struct fb_copyarea *area)
+{
+    sys_copyarea(info, area);
+    vfb_damage_rect(info->par, area->dx, area->dy, area->width, area->height);
+}
+
+static void vfb_imageblit(struct fb_info *info, const struct fb_image *image)
+{
+    sys_imageblit(info, image);
+    vfb_damage_rect(info->par, image->dx, image->dy, image->width, image->height);
+}
+
+#ifdef CONFIG_FB_DEFERRED_IO
+    /*
+     *  Deferred I/O
+     *
+     *  The fbdev core write protects the mmap'ed pages. The first write to a
+     *  page faults, and the page is queued. After deferred_io_delay the queued
+     *  pages are handed to vfb_deferred_io() and write protected again.
+     */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,18,0)
+static void vfb_deferred_io(struct fb_info *info, struct list_head *pagereflist)
+{
+    struct vfb_par *par = info->par;
+    struct fb_deferred_io_pageref *pageref;
+    struct vfb_reader *reader;
+
+    spin_lock_irq(&par->damage_lock);
+    list_for_each_entry(reader, &par->readers, list) {
+        list_for_each_entry(pageref, pagereflist, list) {
+            if ((pageref->offset >> PAGE_SHIFT) < par->dirty_pages_count)
+                __set_bit(pageref->offset >> PAGE_SHIFT, reader->dirty_pages);
+        }
+        /* A reader still taking events fetches the pages after them */
+        if (reader->ring && reader->eventfd)
+            vfb_ring_push(reader);
+        else
+            vfb_signal(reader);
+    }
+    spin_unlock_irq(&par->damage_lock);
+
+    wake_up_interruptible_all(&par->pan_wait);
+}
+#else
+static void vfb_deferred_io(struct fb_info *info, struct list_head *pagelist)
+{
+    struct vfb_par *par = info->par;
+    struct page *page;
+    struct vfb_reader *reader;
+
+    spin_lock_irq(&par->damage_lock);
+    list_for_each_entry(reader, &par->readers, list) {
+        list_for_each_entry(page, pagelist, lru) {
+            if (page->index < par->dirty_pages_count)
+                __set_bit(page->index, reader->dirty_pages);
+        }
+        /* A reader still taking events fetches the pages after them */
+        if (reader->ring && reader->eventfd)
+            vfb_ring_push(reader);
+        else
+            vfb_signal(reader);
+    }
+    spin_unlock_irq(&par->damage_lock);
+
+    wake_up_interruptible_all(&par->pan_wait);
+}
+#endif
+
+/* Copy of vfb_ops using the deferred I/O mmap handler */
+static struct fb_ops vfb_defio_ops;
+#endif /* CONFIG_FB_DEFERRED_IO */
+
+/*
+ *  Allocate the snapshot slots for pages of page_size bytes.
+ */
+static struct vfb_snapshot *vfb_alloc_snapshot(size_t page_size, size_t *total)
+{
+    size_t header = PAGE_ALIGN(sizeof(struct vfb_snapshot));
+    struct vfb_snapshot *snap;
+    u32 i;
+
+    *total = header + (size_t)snapshot * page_size;
+    snap = vmalloc_user(*total);
+    if (!snap)
+        return NULL;
+
+    snap->version = VFB_SNAPSHOT_VERSION;
+    snap->count = snapshot;
+    snap->latest = VFB_SNAPSHOT_NONE;
+    snap->size = *total;
+    for (i = 0; i < snapshot; i++)
+        snap->slots[i].offset = header + (size_t)i * page_size;
+
+    return snap;
+}
+
+/* Video memory that must never be replaced, see vfb_resize_memory() */
+static bool vfb_fixed_memory(struct fb_info *info)
+{
+#ifdef CONFIG_FB_DEFERRED_IO
+    return info->fbdefio != NULL;
+#else
+    return false;
+#endif
+}
+
+/*
+ *  Video memory is allocated for the current mode, and reallocated when a
+ *  mode needs more, or less than half of it. Existing mmaps keep the pages
+ *  they mapped, as remap_vmalloc_range() holds a reference to them, so they
+ *  stay safe to use but are no longer shown. Producers and the viewer map
+ *  again after a mode change. The content is kept, up to the smaller size.
+ *
+ *  Deferred I/O maps pages through its own fault handlers, which look them
+ *  up in the current memory and its page tracking, so those can not be
+ *  replaced while the frame buffer may be mapped. With deferred I/O
+ *  deferred_io_memorysize is allocated up front instead, and only snapshots
+ *  are resized.
+ *
+ *  Memory is only shrunk with shrink set, once the mode is set, as the mode
+ *  may still be backed out after vfb_check_var().
+ *
+ *  Only fails if the memory must grow. Called with the frame buffer lock
+ *  held, which also serializes pans and so the snapshots.
+ */
+static int vfb_resize_memory(struct vfb_par *par, const struct fb_var_screeninfo *var, bool shrink)
+{
+    struct fb_info *info = par->info;
+    u_long line_length = get_line_length(var->xres_virtual, var->bits_per_pixel);
+    size_t size = PAGE_ALIGN(line_length * var->yres_virtual);
+    size_t page_size = PAGE_ALIGN(line_length * var->yres);
+    void *memory = NULL, *old_memory = NULL;
+    struct vfb_snapshot *snap = NULL, *old_snap = NULL;
+    size_t snapshot_size = 0;
+
+    if (!vfb_fixed_memory(info) &&
+        (size > par->videomemory_size || (shrink && size * 2 <= par->videomemory_size))) {
+        memory = vmalloc_32_user(size);
+        if (!memory && size > par->videomemory_size)
+            return -ENOMEM;
+    }
+    /* Without room for the page no snapshots are taken, so failing is not fatal */
+    if (snapshot && (page_size > par->snapshot_slot_size || (shrink && page_size * 2 <= par->snapshot_slot_size)))
+        snap = vfb_alloc_snapshot(page_size, &snapshot_size);
+    if (!memory && !snap)
+        return 0;
+
+    down_write(&par->memory_sem);
+    mutex_lock(&info->mm_lock);
+    if (memory) {
+        memcpy(memory, par->videomemory, min(size, par->videomemory_size));
+        old_memory = par->videomemory;
+        par->videomemory = memory;
+        par->videomemory_size = size;
+        info->screen_base = (char __iomem *)memory;
+        info->fix.smem_start = (unsigned long)memory;
+        info->fix.smem_len = size;
+        spin_lock_irq(&par->damage_lock);
+        par->screeninfo.smem_seq++;
+        spin_unlock_irq(&par->damage_lock);
+    }
+    if (snap) {
+        old_snap = par->snapshot;
+        par->snapshot = snap;
+        par->snapshot_size = snapshot_size;
+        par->snapshot_slot_size = page_size;
+    }
+    mutex_unlock(&info->mm_lock);
+    up_write(&par->memory_sem);
+
+    vfree(old_memory);
+    vfree(old_snap);
+
+    PRINT("Video memory resized to %zu bytes\n", size);
+
+    return 0;
+}
+
     /*
      *  Setting the video mode has been split into two parts.
      *  First part, xxxfb_check_var, must not write anything
@@ -161,6 +985,7 @@ static u_long get_line_length(int xres_virtual, int bpp)
 static int vfb_check_var(struct fb_var_screeninfo *var,
              struct fb_info *info)
 {
+    struct vfb_par *par = info->par;
     u_long line_length;
 
     /*
@@ -210,6 +1035,9 @@ static int vfb_check_var(struct fb_var_screeninfo *var,
         get_line_length(var->xres_virtual, var->bits_per_pixel);
     if (line_length * var->yres_virtual > videomemorysize)
         return -ENOMEM;
+    /* With deferred I/O the memory allocated at probe is all there is */
+    if (vfb_fixed_memory(info) && line_length * var->yres_virtual > par->videomemory_size)
+        return -ENOMEM;
 
     /*
      * Now that we checked it we alter var. The reason being is that the video
@@ -278,6 +1106,15 @@ static int vfb_check_var(struct fb_var_screeninfo *var,
     var->blue.msb_right = 0;
     var->transp.msb_right = 0;
 
+    /*
+     *  fb_set_var() ignores errors from fb_set_par, so memory for a mode
+     *  about to be set is allocated here, where failing rejects the mode.
+     *  It is only grown, the old mode stays in use if the new one is backed
+     *  out. No memory is allocated yet while probing.
+     */
+    if ((var->activate & FB_ACTIVATE_MASK) == FB_ACTIVATE_NOW && par->videomemory)
+        return vfb_resize_memory(par, var, false);
+
     return 0;
 }
 
@@ -287,6 +1124,8 @@ static int vfb_check_var(struct fb_var_screeninfo *var,
  */
 static int vfb_set_par(struct fb_info *info)
 {
+    struct vfb_par *par = info->par;
+
     switch (info->var.bits_per_pixel) {
     case 1:
         info->fix.visual = FB_VISUAL_MONO01;
@@ -306,6 +1145,20 @@ static int vfb_set_par(struct fb_info *info)
     info->fix.line_length = get_line_length(info->var.xres_virtual,
                         info->var.bits_per_pixel);
 
+    /* Normally only shrinks, vfb_check_var() has made room for the mode */
+    if (vfb_resize_memory(par, &info->var, true))
+        return -ENOMEM;
+
+    vfb_set_vblank_period(par, &info->var);
+
+    spin_lock_irq(&par->damage_lock);
+    par->screeninfo.var = info->var;
+    par->screeninfo.line_length = info->fix.line_length;
+    par->screeninfo.smem_len = info->fix.smem_len;
+    vfb_report(par, VFB_EVENT_MODE_CHANGE | VFB_EVENT_DAMAGE_FULL, VFB_DAMAGE_FULL);
+    spin_unlock_irq(&par->damage_lock);
+    wake_up_interruptible_all(&par->pan_wait);
+
     return 0;
 }
 
@@ -318,8 +1171,19 @@ static int vfb_set_par(struct fb_info *info)
 static int vfb_setcolreg(u_int regno, u_int red, u_int green, u_int blue,
              u_int transp, struct fb_info *info)
 {
+    struct vfb_par *par = info->par;
+    unsigned long flags;
+
     if (regno >= 256)   /* no. of hw registers */
         return 1;
+
+    /* As FBIOGETCMAP returns it, for VFB_IOCTL_GET_SCREENINFO */
+    spin_lock_irqsave(&par->damage_lock, flags);
+    par->screeninfo.red[regno] = red;
+    par->screeninfo.green[regno] = green;
+    par->screeninfo.blue[regno] = blue;
+    spin_unlock_irqrestore(&par->damage_lock, flags);
+
     /*
      * Program hardware... do anything you want with transp
      */
@@ -404,15 +1268,92 @@ static int vfb_setcolreg(u_int regno, u_int red, u_int green, u_int blue,
     return 0;
 }
 
+/*
+ *  Set a range of color registers, like the fbdev core does without this,
+ *  and report the change to the readers once for the whole range.
+ */
+static int vfb_setcmap(struct fb_cmap *cmap, struct fb_info *info)
+{
+    struct vfb_par *par = info->par;
+    unsigned long flags;
+    u32 i;
+
+    for (i = 0; i < cmap->len; i++) {
+        if (vfb_setcolreg(cmap->start + i, cmap->red[i], cmap->green[i], cmap->blue[i],
+                  cmap->transp ? cmap->transp[i] : 0xffff, info))
+            break;
+    }
+
+    spin_lock_irqsave(&par->damage_lock, flags);
+    vfb_report(par, VFB_EVENT_PALETTE | VFB_EVENT_DAMAGE_FULL, VFB_DAMAGE_FULL);
+    spin_unlock_irqrestore(&par->damage_lock, flags);
+    wake_up_interruptible_all(&par->pan_wait);
+
+    return 0;
+}
+
     /*
      *  Pan or Wrap the Display
      *
      *  This call looks only at xoffset, yoffset and the FB_VMODE_YWRAP flag
      */
 
+/*
+ *  Copy the page shown after a pan into the next snapshot slot. Pans are
+ *  serialized by the frame buffer lock, so only the viewers race with this,
+ *  and they detect it by the change of the slot seq.
+ */
+static void vfb_take_snapshot(struct vfb_par *par, const struct fb_var_screeninfo *var)
+{
+    struct fb_info *info = par->info;
+    struct vfb_snapshot *snap = par->snapshot;
+    struct vfb_snapshot_slot *slot;
+    u32 line_length = info->fix.line_length;
+    u32 rows = info->var.yres;
+    u32 first = rows;
+    u32 index;
+    u8 *dst;
+
+    if (!snap || (size_t)line_length * rows > par->snapshot_slot_size)
+        return;
+
+    index = snap->latest == VFB_SNAPSHOT_NONE ? 0 : (snap->latest + 1) % snap->count;
+    slot = &snap->slots[index];
+    dst = (u8 *)snap + slot->offset;
+
+    /* Odd while the slot is written */
+    WRITE_ONCE(slot->seq, slot->seq + 1);
+    smp_wmb();
+
+    /* Rows past the end of the virtual screen wrap to the top with FB_VMODE_YWRAP */
+    if (var->vmode & FB_VMODE_YWRAP)
+        first = min(rows, info->var.yres_virtual - var->yoffset);
+    memcpy(dst, (u8 *)par->videomemory + (size_t)var->yoffset * line_length,
+           (size_t)first * line_length);
+    if (first < rows)
+        memcpy(dst + (size_t)first * line_length, par->videomemory,
+               (size_t)(rows - first) * line_length);
+
+    slot->pan_seq = READ_ONCE(par->pan_seq) + 1;
+    slot->xoffset = var->xoffset;
+    slot->yoffset = var->yoffset;
+    slot->xres = info->var.xres;
+    slot->yres = rows;
+    slot->bits_per_pixel = info->var.bits_per_pixel;
+    slot->line_length = line_length;
+
+    smp_wmb();
+    WRITE_ONCE(slot->seq, slot->seq + 1);
+    smp_store_release(&snap->latest, index);
+}
+
 static int vfb_pan_display(struct fb_var_screeninfo *var,
                struct fb_info *info)
 {
+    struct vfb_par *par = info->par;
+    bool wait_for_ack;
+    u32 seq;
+
     if (var->vmode & FB_VMODE_YWRAP) {
         if (var->yoffset >= info->var.yres_virtual ||
             var->xoffset)
@@ -423,23 +1364,57 @@ static int vfb_pan_display(struct fb_var_screeninfo *var,
             return -EINVAL;
     }
 
-    mutex_lock(&view_mutex);
+#ifdef CONFIG_FB_DEFERRED_IO
+    /* Report pages written before the pan, before the viewer is woken */
+    if (info->fbdefio)
+        flush_delayed_work(&info->deferred_work);
+#endif
+
+    PRINT("Display panned. yoffset: %d, %d", var->yoffset, (var->vmode & FB_VMODE_YWRAP));
+
+    /* Before the pan is published, so the viewer never sees it without its copy */
+    vfb_take_snapshot(par, var);
 
+    /* Readers never hold damage_lock for more than a copy of the damage, so
+     * a pan does not wait for them */
+    spin_lock_irq(&par->damage_lock);
+    write_seqlock(&par->scanout_lock);
     info->var.xoffset = var->xoffset;
     info->var.yoffset = var->yoffset;
     if (var->vmode & FB_VMODE_YWRAP)
         info->var.vmode |= FB_VMODE_YWRAP;
     else
         info->var.vmode &= ~FB_VMODE_YWRAP;
+    seq = ++par->pan_seq;
+    par->pan_time = ktime_get();
+    if (pan_at_vblank) {
+        /* Latched, a later pan before the vertical blank replaces it */
+        par->pending_pan.xoffset = var->xoffset;
+        par->pending_pan.yoffset = var->yoffset;
+        par->pending_pan.ywrap = var->vmode & FB_VMODE_YWRAP;
+        par->pending_pan.seq = seq;
+        par->pan_pending = true;
+        vfb_vblank_arm(par);
+    } else {
+        par->scanout.xoffset = var->xoffset;
+        par->scanout.yoffset = var->yoffset;
+        par->scanout.ywrap = var->vmode & FB_VMODE_YWRAP;
+        par->scanout.seq = seq;
+    }
+    write_sequnlock(&par->scanout_lock);
+    if (!pan_at_vblank)
+        vfb_report_pan(par);
+    spin_unlock_irq(&par->damage_lock);
 
-    PRINT("Display panned. yoffset: %d, %d", info->var.yoffset, (var->vmode & FB_VMODE_YWRAP));
-
-    panned = 1;
+    if (!pan_at_vblank)
+        wake_up_interruptible_all(&par->pan_wait);
 
-    wake_up_interruptible(&pan_wait);
+    wait_for_ack = flip_ack && atomic_read(&par->ack_viewers) > 0;
 
-    mutex_unlock(&view_mutex);
-    usleep_range(500, 1000);
+    /* The frame buffer lock is held, so an acknowledging viewer only uses
+     * /dev/fb_view meanwhile, see VFB_IOCTL_GET_SCREENINFO */
+    if (wait_for_ack)
+        vfb_wait_for_ack(par, seq);
 
     return 0;
 }
@@ -461,142 +1436,471 @@ static int vfb_mmap(struct fb_info *info,
 
 static int dev_open(struct inode *inodep, struct file *filep)
 {
-    int err = 0;
+    struct vfb_par *par = NULL;
+    struct vfb_reader *reader;
 
     PRINT("dev_open enter\n");
 
-    mutex_lock(&view_mutex);
-    panned = 0;
-    mutex_unlock(&view_mutex);
+    if (iminor(inodep) < VFB_MAX_INSTANCES)
+        par = vfb_instances[iminor(inodep)];
+    if (!par)
+        return -ENODEV;
 
-    return err;
+    reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+    if (!reader)
+        return -ENOMEM;
+    reader->par = par;
+
+    if (par->dirty_pages_count) {
+        reader->dirty_pages = bitmap_zalloc(par->dirty_pages_count, GFP_KERNEL);
+        if (!reader->dirty_pages) {
+            kfree(reader);
+            return -ENOMEM;
+        }
+    }
+
+    /* Readers get the legacy format until they select a protocol, and
+     * nothing is known about what was drawn before they opened the device */
+    reader->damage.flags = VFB_DAMAGE_FULL;
+    filep->private_data = reader;
+
+    spin_lock_irq(&par->damage_lock);
+    list_add_tail(&reader->list, &par->readers);
+    spin_unlock_irq(&par->damage_lock);
+
+    return 0;
 }
 
 static int dev_release(struct inode *inodep, struct file *filep)
 {
+    struct vfb_reader *reader = filep->private_data;
+    struct vfb_par *par = reader->par;
+    bool acking;
     int err = 0;
 
     PRINT("dev_release enter\n");
 
-    mutex_lock(&view_mutex);
-    panned = -1;
-    mutex_unlock(&view_mutex);
+    spin_lock_irq(&par->damage_lock);
+    list_del(&reader->list);
+    acking = reader->acking;
+    spin_unlock_irq(&par->damage_lock);
+
+    if (reader->eventfd)
+        eventfd_ctx_put(reader->eventfd);
+    bitmap_free(reader->dirty_pages);
+    vfree(reader->ring);
+    kfree(reader);
+
+    /* Do not leave producers waiting when the last acknowledging viewer is gone */
+    if (acking && atomic_dec_and_test(&par->ack_viewers)) {
+        spin_lock_irq(&par->damage_lock);
+        par->acked_seq = par->pan_seq;
+        spin_unlock_irq(&par->damage_lock);
+        wake_up_interruptible_all(&par->ack_wait);
+    }
 
     return err;
 }
 
 static unsigned int dev_poll(struct file *filep, poll_table *wait)
 {
+    struct vfb_reader *reader = filep->private_data;
     unsigned int ret = 0;
 
     PRINT("dev_poll enter\n");
 
-    poll_wait(filep, &pan_wait, wait);
-
-    mutex_lock(&view_mutex);
+    poll_wait(filep, &reader->par->pan_wait, wait);
 
-    if (panned == 1) {
+    if (READ_ONCE(reader->ring)) {
+        if (vfb_ring_flush(reader))
+            ret = POLLIN | POLLRDNORM;
+    } else if (vfb_damage_pending(reader)) {
         ret = POLLIN | POLLRDNORM;
     }
 
-    mutex_unlock(&view_mutex);
-
     PRINT("dev_poll exit. return(%u)\n", ret);
 
     return ret;
 }
 
 
+static ssize_t dev_read_events(struct vfb_reader *reader, char *buffer, size_t len)
+{
+    struct vfb_par *par = reader->par;
+    struct vfb_event *events;
+    u32 max = min_t(size_t, len / sizeof(struct vfb_event), VFB_EVENT_QUEUE_LEN);
+    u32 i, copied;
+    ssize_t ret;
+
+    if (READ_ONCE(reader->ring)) {
+        vfb_ring_flush(reader);
+        return 0;
+    }
+
+    if (!max)
+        return -EINVAL;
+
+    events = kmalloc_array(max, sizeof(struct vfb_event), GFP_KERNEL);
+    if (!events)
+        return -ENOMEM;
+
+    spin_lock_irq(&par->damage_lock);
+    /* Damage not attached to a pan, or the current state if nothing happened */
+    if (reader->damage.count || reader->damage.flags || !reader->event_count)
+        vfb_queue_event(reader, 0);
+    copied = min(max, reader->event_count);
+    for (i = 0; i < copied; i++)
+        events[i] = reader->event_queue[(reader->event_head + i) % VFB_EVENT_QUEUE_LEN];
+    reader->event_head = (reader->event_head + copied) % VFB_EVENT_QUEUE_LEN;
+    reader->event_count -= copied;
+    spin_unlock_irq(&par->damage_lock);
+
+    ret = copied * sizeof(struct vfb_event);
+    if (copy_to_user(buffer, events, ret))
+        ret = -EFAULT;
+    kfree(events);
+
+    PRINT("dev_read_events exit. Return(%d)\n", (int)ret);
+
+    return ret;
+}
+
 static ssize_t dev_read(struct file *filep, char *buffer, size_t len, loff_t *offset)
 {
+    struct vfb_reader *reader = filep->private_data;
+    struct vfb_par *par = reader->par;
     int remaining;
     u32 result;
+    struct vfb_damage dmg;
+    struct fb_var_screeninfo var;
+    struct vfb_scanout scanout;
+    unsigned int seq;
+    const size_t with_damage = sizeof(struct fb_var_screeninfo) + sizeof(struct vfb_damage);
 
     PRINT("dev_read enter. len(%u) offset(%u)\n", (u32)len, (u32)*offset);
 
-    if (len > sizeof(struct fb_var_screeninfo)) {
-        return -ENOBUFS;
-    }
-/*
-    if (panned == 0) {
-        if (filep->f_flags & O_NONBLOCK) {
-            return -EAGAIN;
-        }
-    }
+    if (READ_ONCE(reader->protocol) >= 1)
+        return dev_read_events(reader, buffer, len);
 
-    while (panned != 1) {
-        if (panned == -1) {
-            return -ENODATA;
-        }
-        msleep(10);
+    if (len > sizeof(struct fb_var_screeninfo) && len != with_damage) {
+        return -ENOBUFS;
     }
-*/
-    mutex_lock(&view_mutex);
-
-    panned = 0;
+    spin_lock_irq(&par->damage_lock);
+    dmg = reader->damage;
+    reader->damage.flags = 0;
+    reader->damage.count = 0;
+    spin_unlock_irq(&par->damage_lock);
+
+    /* Taken after the damage, so a pan in between is reported again by the next read */
+    do {
+        seq = read_seqbegin(&par->scanout_lock);
+        var = par->info->var;
+        scanout = par->scanout;
+    } while (read_seqretry(&par->scanout_lock, seq));
+
+    /* The offsets last shown, which lag behind info->var with pan_at_vblank */
+    var.xoffset = scanout.xoffset;
+    var.yoffset = scanout.yoffset;
+    dmg.pan_seq = scanout.seq;
+    if (scanout.ywrap)
+        var.vmode |= FB_VMODE_YWRAP;
+    else
+        var.vmode &= ~FB_VMODE_YWRAP;
 
     result = min((int)len, (int)sizeof(struct fb_var_screeninfo));
 
     PRINT("dev_read: Copying %u bytes of data\n", result);
-    PRINT("dev_read. yoffset: %d", fb_var_info->yoffset);
+    PRINT("dev_read. yoffset: %d", var.yoffset);
 
-    remaining = copy_to_user(buffer, fb_var_info, result);
+    remaining = copy_to_user(buffer, &var, result);
+    if (0 == remaining && len == with_damage) {
+        remaining = copy_to_user(buffer + result, &dmg, sizeof(dmg));
+        result += sizeof(dmg);
+    }
 
     /* copy_to_user returns number of bytes that could NOT be copied: 0 = success. */
     if(0 != remaining) {
-        mutex_unlock(&view_mutex);
         pr_err("copy_to_user failed. Remaining=(%d)\n", remaining);
         return -ENOBUFS;
     }
 
     *offset += result;
 
-    mutex_unlock(&view_mutex);
-
     PRINT("dev_read exit. Return(%u)\n", result );
 
     return result;
 }
 
 
+static long vfb_get_dirty_pages(struct vfb_reader *reader, struct vfb_dirty_pages __user *arg)
+{
+    struct vfb_par *par = reader->par;
+    struct vfb_dirty_pages req;
+    u32 *words;
+    u32 bits;
+    long ret = 0;
+
+    if (!reader->dirty_pages)
+        return -EOPNOTSUPP;
+
+    if (copy_from_user(&req, arg, sizeof(req)))
+        return -EFAULT;
+
+    if (req.bitmap && req.count) {
+        bits = min(req.count, par->dirty_pages_count);
+        words = kcalloc(DIV_ROUND_UP(bits, 32), sizeof(u32), GFP_KERNEL);
+        if (!words)
+            return -ENOMEM;
+
+        spin_lock_irq(&par->damage_lock);
+        bitmap_to_arr32(words, reader->dirty_pages, bits);
+        bitmap_clear(reader->dirty_pages, 0, bits);
+        spin_unlock_irq(&par->damage_lock);
+
+        if (copy_to_user(u64_to_user_ptr(req.bitmap), words, DIV_ROUND_UP(bits, 32) * sizeof(u32)))
+            ret = -EFAULT;
+        kfree(words);
+        if (ret)
+            return ret;
+    }
+
+    req.page_size = PAGE_SIZE;
+    req.count = par->dirty_pages_count;
+    if (copy_to_user(arg, &req, sizeof(req)))
+        return -EFAULT;
+
+    return 0;
+}
+
+static long vfb_get_screeninfo(struct vfb_reader *reader, struct vfb_screeninfo __user *arg)
+{
+    struct vfb_par *par = reader->par;
+    struct vfb_screeninfo *si;
+    long ret = 0;
+
+    si = kmalloc(sizeof(*si), GFP_KERNEL);
+    if (!si)
+        return -ENOMEM;
+
+    spin_lock_irq(&par->damage_lock);
+    *si = par->screeninfo;
+    spin_unlock_irq(&par->damage_lock);
+
+    if (copy_to_user(arg, si, sizeof(*si)))
+        ret = -EFAULT;
+    kfree(si);
+
+    return ret;
+}
+
+static long vfb_set_protocol(struct vfb_reader *reader, u32 __user *arg)
+{
+    struct vfb_par *par = reader->par;
+    u32 version;
+
+    if (get_user(version, arg))
+        return -EFAULT;
+    if (version > VFB_EVENT_VERSION)
+        return -EINVAL;
+
+    spin_lock_irq(&par->damage_lock);
+    reader->protocol = version;
+    reader->event_count = 0;
+    spin_unlock_irq(&par->damage_lock);
+
+    return 0;
+}
+
+static long vfb_set_eventfd(struct vfb_reader *reader, s32 __user *arg)
+{
+    struct vfb_par *par = reader->par;
+    struct eventfd_ctx *ctx = NULL;
+    struct eventfd_ctx *old;
+    s32 fd;
+
+    if (get_user(fd, arg))
+        return -EFAULT;
+    if (fd >= 0) {
+        ctx = eventfd_ctx_fdget(fd);
+        if (IS_ERR(ctx))
+            return PTR_ERR(ctx);
+    }
+
+    spin_lock_irq(&par->damage_lock);
+    old = reader->eventfd;
+    reader->eventfd = ctx;
+    spin_unlock_irq(&par->damage_lock);
+
+    if (old)
+        eventfd_ctx_put(old);
+
+    return 0;
+}
+
+static int vfb_mmap_snapshot(struct vfb_par *par, struct vm_area_struct *vma)
+{
+    int ret;
+
+    /* Shared by all viewers, so it can not be written */
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+    /* The snapshots are replaced by a mode change under mm_lock */
+    mutex_lock(&par->info->mm_lock);
+    if (!par->snapshot)
+        ret = -ENODEV;
+    else if (vma->vm_end - vma->vm_start > par->snapshot_size)
+        ret = -EINVAL;
+    else
+        ret = remap_vmalloc_range(vma, par->snapshot, 0);
+    mutex_unlock(&par->info->mm_lock);
+
+    return ret;
+}
+
+static int dev_mmap(struct file *filep, struct vm_area_struct *vma)
+{
+    struct vfb_reader *reader = filep->private_data;
+    struct vfb_par *par = reader->par;
+    size_t size = PAGE_ALIGN(sizeof(struct vfb_ring));
+    struct vfb_ring *ring;
+
+    if (vma->vm_pgoff == VFB_SNAPSHOT_OFFSET >> PAGE_SHIFT)
+        return vfb_mmap_snapshot(par, vma);
+
+    if (READ_ONCE(reader->protocol) < 1)
+        return -EINVAL;
+    if (vma->vm_pgoff || vma->vm_end - vma->vm_start > size)
+        return -EINVAL;
+
+    if (!READ_ONCE(reader->ring)) {
+        ring = vmalloc_user(size);
+        if (!ring)
+            return -ENOMEM;
+        ring->version = VFB_EVENT_VERSION;
+        ring->len = VFB_RING_LEN;
+
+        spin_lock_irq(&par->damage_lock);
+        if (!reader->ring) {
+            /* Events queued for read() are not moved, start over with a full redraw */
+            reader->event_count = 0;
+            reader->damage.flags |= VFB_DAMAGE_FULL;
+            reader->damage.count = 0;
+            reader->ring_head = 0;
+            WRITE_ONCE(reader->ring, ring);
+            ring = NULL;
+        }
+        spin_unlock_irq(&par->damage_lock);
+        vfree(ring);
+    }
+
+    return remap_vmalloc_range(vma, reader->ring, 0);
+}
+
+static long dev_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
+{
+    struct vfb_reader *reader = filep->private_data;
+
+    PRINT("dev_ioctl enter. cmd(%u)\n", cmd);
+
+    switch (cmd) {
+    case VFB_IOCTL_GET_DIRTY_PAGES:
+        return vfb_get_dirty_pages(reader, (struct vfb_dirty_pages __user *)arg);
+    case VFB_IOCTL_ACK_FLIP:
+        return vfb_ack_flip(reader, (struct vfb_flip_ack __user *)arg);
+    case VFB_IOCTL_SET_PROTOCOL:
+        return vfb_set_protocol(reader, (u32 __user *)arg);
+    case VFB_IOCTL_SET_EVENTFD:
+        return vfb_set_eventfd(reader, (s32 __user *)arg);
+    case VFB_IOCTL_GET_SCREENINFO:
+        return vfb_get_screeninfo(reader, (struct vfb_screeninfo __user *)arg);
+    default:
+        return -ENOTTY;
+    }
+}
+
+
 /*
  *  Initialisation
  */
 static int vfb_probe(struct platform_device *dev)
 {
     struct fb_info *info;
-    unsigned int size = PAGE_ALIGN(videomemorysize);
+    struct vfb_par *par;
+    u_long line_length;
+    const char *mode = NULL;
     int retval = -ENOMEM;
 
-    /*
-     * For real video cards we use ioremap.
-     */
-    if (!(videomemory = vmalloc_32_user(size))) {
-        fb_err(info, "Unable to allocate video memory.\n");
-        return retval;
-    }
+    if (dev->id < 0 || dev->id >= VFB_MAX_INSTANCES)
+        return -EINVAL;
+    if (dev->id < mode_option_count)
+        mode = mode_option[dev->id];
 
-    info = framebuffer_alloc(sizeof(u32) * 256, &dev->dev);
+    info = framebuffer_alloc(sizeof(struct vfb_par), &dev->dev);
     if (!info) {
-        fb_err(info, "Unable to allocate framebuffer.\n");
-        goto err;
+        dev_err(&dev->dev, "Unable to allocate framebuffer.\n");
+        return retval;
     }
 
-    info->screen_base = (char __iomem *)videomemory;
+    par = info->par;
+    par->info = info;
+    par->instance = dev->id;
+    init_waitqueue_head(&par->pan_wait);
+    init_waitqueue_head(&par->vblank_wait);
+    init_waitqueue_head(&par->ack_wait);
+    spin_lock_init(&par->damage_lock);
+    seqlock_init(&par->scanout_lock);
+    INIT_LIST_HEAD(&par->readers);
+    init_rwsem(&par->memory_sem);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,13,0)
+    hrtimer_setup(&par->vblank_timer, vfb_vblank, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+    hrtimer_init(&par->vblank_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    par->vblank_timer.function = vfb_vblank;
+#endif
+
     info->fbops = (struct fb_ops*)&vfb_ops;
 
-    if (!fb_find_mode(&info->var, info, mode_option,
+    if (!fb_find_mode(&info->var, info, mode,
               NULL, 0, &vfb_default, 32)){
         fb_err(info, "Unable to find usable video mode.\n");
         retval = -EINVAL;
-        goto err1;
+        goto err;
+    }
+
+    /*
+     * For real video cards we use ioremap. Only the mode found is allocated,
+     * later modes reallocate in vfb_resize_memory().
+     */
+    line_length = get_line_length(info->var.xres_virtual, info->var.bits_per_pixel);
+    par->videomemory_size = PAGE_ALIGN(line_length * info->var.yres_virtual);
+    /* Never replaced with deferred I/O, so later modes must fit in it */
+    if (deferred_io && IS_ENABLED(CONFIG_FB_DEFERRED_IO))
+        par->videomemory_size = max_t(size_t, par->videomemory_size,
+                          PAGE_ALIGN(min(deferred_io_memorysize, videomemorysize)));
+    if (!(par->videomemory = vmalloc_32_user(par->videomemory_size))) {
+        fb_err(info, "Unable to allocate video memory.\n");
+        goto err;
     }
 
-    vfb_fix.smem_start = (unsigned long) videomemory;
-    vfb_fix.smem_len = videomemorysize;
+    if (snapshot) {
+        par->snapshot_slot_size = PAGE_ALIGN(line_length * info->var.yres);
+        if (!(par->snapshot = vfb_alloc_snapshot(par->snapshot_slot_size, &par->snapshot_size))) {
+            fb_err(info, "Unable to allocate snapshot memory.\n");
+            goto err1;
+        }
+    }
+
+    info->screen_base = (char __iomem *)par->videomemory;
     info->fix = vfb_fix;
-    info->pseudo_palette = info->par;
-    info->par = NULL;
+    info->fix.smem_start = (unsigned long) par->videomemory;
+    info->fix.smem_len = par->videomemory_size;
+    info->pseudo_palette = par->pseudo_palette;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5,16,0)
     info->flags = FBINFO_FLAG_DEFAULT;
 #else
@@ -608,6 +1912,28 @@ static int vfb_probe(struct platform_device *dev)
         fb_err(info, "Unable to allocate cmap.\n");
         goto err1;
     }
+    memcpy(par->screeninfo.red, info->cmap.red, sizeof(par->screeninfo.red));
+    memcpy(par->screeninfo.green, info->cmap.green, sizeof(par->screeninfo.green));
+    memcpy(par->screeninfo.blue, info->cmap.blue, sizeof(par->screeninfo.blue));
+
+    if (deferred_io) {
+#ifdef CONFIG_FB_DEFERRED_IO
+        /* The memory is never reallocated, so reader bitmaps survive mode changes */
+        par->dirty_pages_count = par->videomemory_size >> PAGE_SHIFT;
+        par->defio.delay = msecs_to_jiffies(deferred_io_delay);
+        par->defio.deferred_io = vfb_deferred_io;
+        vfb_defio_ops = vfb_ops;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,19,0)
+        /* Older kernels install the handler in fb_deferred_io_init() */
+        vfb_defio_ops.fb_mmap = fb_deferred_io_mmap;
+#endif
+        info->fbops = &vfb_defio_ops;
+        info->fbdefio = &par->defio;
+        fb_deferred_io_init(info);
+#else
+        fb_warn(info, "Kernel built without CONFIG_FB_DEFERRED_IO, deferred_io ignored.\n");
+#endif
+    }
 
     retval = register_framebuffer(info);
     if (retval < 0) {
@@ -616,47 +1942,43 @@ static int vfb_probe(struct platform_device *dev)
     }
     platform_set_drvdata(dev, info);
 
-    vfb_set_par(info);
+    par->scanout.xoffset = info->var.xoffset;
+    par->scanout.yoffset = info->var.yoffset;
+    par->scanout.ywrap = info->var.vmode & FB_VMODE_YWRAP;
 
-    fb_info(info, "Virtual frame buffer device, using %ldK of video memory\n",
-        videomemorysize >> 10);
+    vfb_set_par(info);
 
-    majorNumber = register_chrdev(0, DEVICE_NAME, &fops);
-    if (majorNumber < 0) {
-        dev_err(&dev->dev, DEVICE_NAME " failed to register a major number\n");
-        return majorNumber;
-    }
+    fb_info(info, "Virtual frame buffer device, using %zuK of up to %ldK of video memory\n",
+        par->videomemory_size >> 10, videomemorysize >> 10);
 
-#if LINUX_VERSION_CODE <= KERNEL_VERSION(6,3,0)
-    viewClass = class_create(THIS_MODULE, DEVICE_NAME);
-#else
-    viewClass = class_create(DEVICE_NAME);
-#endif
-    if (IS_ERR(viewClass)) {
-        unregister_chrdev(majorNumber, DEVICE_NAME);
-        dev_err(&dev->dev, "Failed to register device class\n");
-        return PTR_ERR(viewClass);
-    }
-
-    viewDevice = device_create(viewClass, &dev->dev, MKDEV(majorNumber, 0), dev, DEVICE_NAME);
-    if (IS_ERR(viewDevice)) {
-        class_destroy(viewClass);
-        unregister_chrdev(majorNumber, DEVICE_NAME);
+    /* The first instance keeps the name used before instances were added */
+    vfb_instances[dev->id] = par;
+    if (dev->id == 0)
+        par->view_device = device_create(viewClass, &dev->dev, MKDEV(majorNumber, 0), par, DEVICE_NAME);
+    else
+        par->view_device = device_create(viewClass, &dev->dev, MKDEV(majorNumber, dev->id), par, DEVICE_NAME "%d", dev->id);
+    if (IS_ERR(par->view_device)) {
         dev_err(&dev->dev, "Failed to create the device\n");
-        return PTR_ERR(viewDevice);
+        retval = PTR_ERR(par->view_device);
+        goto err3;
     }
 
-    fb_var_info = &info->var;
-
-    mutex_init(&view_mutex);
-
     return 0;
+err3:
+    vfb_instances[dev->id] = NULL;
+    unregister_framebuffer(info);
+    hrtimer_cancel(&par->vblank_timer);
 err2:
+#ifdef CONFIG_FB_DEFERRED_IO
+    if (info->fbdefio)
+        fb_deferred_io_cleanup(info);
+#endif
     fb_dealloc_cmap(&info->cmap);
 err1:
-    framebuffer_release(info);
+    vfree(par->snapshot);
+    vfree(par->videomemory);
 err:
-    vfree(videomemory);
+    framebuffer_release(info);
     return retval;
 }
 
@@ -669,15 +1991,21 @@ static void vfb_remove(struct platform_device *dev)
     struct fb_info *info = platform_get_drvdata(dev);
 
     if (info) {
+        struct vfb_par *par = info->par;
+
+        device_destroy(viewClass, MKDEV(majorNumber, par->instance));
+        vfb_instances[par->instance] = NULL;
         unregister_framebuffer(info);
-        vfree(videomemory);
+        /* Nothing arms it any more */
+        hrtimer_cancel(&par->vblank_timer);
+#ifdef CONFIG_FB_DEFERRED_IO
+        if (info->fbdefio)
+            fb_deferred_io_cleanup(info);
+#endif
+        vfree(par->snapshot);
+        vfree(par->videomemory);
         fb_dealloc_cmap(&info->cmap);
         framebuffer_release(info);
-
-        device_destroy(viewClass, MKDEV(majorNumber, 0));
-        class_unregister(viewClass);
-        class_destroy(viewClass);
-        unregister_chrdev(majorNumber, DEVICE_NAME);
     }
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(6,10,0)
     return 0;
@@ -694,28 +2022,69 @@ static struct platform_driver vfb_driver = {
     },
 };
 
-static struct platform_device *vfb_device;
+static struct platform_device *vfb_devices[VFB_MAX_INSTANCES];
 
 static int __init vfb_init(void)
 {
     int ret = 0;
+    uint i;
+
+    if (!instances || instances > VFB_MAX_INSTANCES) {
+        pr_err("vfb2: instances must be 1 to %d\n", VFB_MAX_INSTANCES);
+        return -EINVAL;
+    }
+    if (snapshot > VFB_SNAPSHOT_MAX_SLOTS) {
+        pr_err("vfb2: snapshot must be 0 to %d\n", VFB_SNAPSHOT_MAX_SLOTS);
+        return -EINVAL;
+    }
+
+    majorNumber = register_chrdev(0, DEVICE_NAME, &fops);
+    if (majorNumber < 0) {
+        pr_err(DEVICE_NAME " failed to register a major number\n");
+        return majorNumber;
+    }
+
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(6,3,0)
+    viewClass = class_create(THIS_MODULE, DEVICE_NAME);
+#else
+    viewClass = class_create(DEVICE_NAME);
+#endif
+    if (IS_ERR(viewClass)) {
+        unregister_chrdev(majorNumber, DEVICE_NAME);
+        pr_err("Failed to register device class\n");
+        return PTR_ERR(viewClass);
+    }
 
     ret = platform_driver_register(&vfb_driver);
+    if (ret)
+        goto err_class;
 
-    if (!ret) {
-        vfb_device = platform_device_alloc("vfb2", 0);
+    for (i = 0; i < instances; i++) {
+        vfb_devices[i] = platform_device_alloc("vfb2", i);
 
-        if (vfb_device)
-            ret = platform_device_add(vfb_device);
+        if (vfb_devices[i])
+            ret = platform_device_add(vfb_devices[i]);
         else
             ret = -ENOMEM;
 
         if (ret) {
-            platform_device_put(vfb_device);
-            platform_driver_unregister(&vfb_driver);
+            platform_device_put(vfb_devices[i]);
+            vfb_devices[i] = NULL;
+            goto err_devices;
         }
     }
 
+    return 0;
+
+err_devices:
+    while (i--) {
+        platform_device_unregister(vfb_devices[i]);
+        vfb_devices[i] = NULL;
+    }
+    platform_driver_unregister(&vfb_driver);
+err_class:
+    class_destroy(viewClass);
+    unregister_chrdev(majorNumber, DEVICE_NAME);
     return ret;
 }
 
@@ -724,8 +2093,15 @@ module_init(vfb_init);
 #ifdef MODULE
 static void __exit vfb_exit(void)
 {
-    platform_device_unregister(vfb_device);
+    uint i = instances;
+
+    while (i--) {
+        if (vfb_devices[i])
+            platform_device_unregister(vfb_devices[i]);
+    }
     platform_driver_unregister(&vfb_driver);
+    class_destroy(viewClass);
+    unregister_chrdev(majorNumber, DEVICE_NAME);
 }
 
 module_exit(vfb_exit);
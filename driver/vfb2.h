@@ -0,0 +1,260 @@
+/*
+ *  vfb2.h -- Interface between the vfb2 driver and the viewer.
+ *
+ *      Copyright (C) 2021 RSP Systems <software@rspsystems.com>
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License. See the file COPYING in the main directory of this archive for
+ *  more details.
+ *
+ */
+
+/**
+ *  Structures returned by the /dev/fb_view character device. The header is
+ *  shared by the kernel module and the emul_fb viewer, so only use uapi
+ *  headers here.
+ */
+
+#ifndef VFB2_H_
+#define VFB2_H_
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#include <linux/fb.h>
+
+/*
+ *  Damage tracking
+ *
+ *  The driver collects the areas touched by write(), fillrect, copyarea and
+ *  imageblit. Reading sizeof(struct fb_var_screeninfo) + sizeof(struct vfb_damage)
+ *  bytes from /dev/fb_view returns the screen info followed by the damage
+ *  collected since the previous read. Reading only sizeof(struct fb_var_screeninfo)
+ *  bytes is still supported, and discards the damage.
+ *
+ *  Writes through mmap are not seen by the driver, so a reader must treat a
+ *  pan (VFB_DAMAGE_PANNED) as if the whole visible page has changed.
+ */
+
+#define VFB_MAX_DAMAGE_RECTS    16
+
+/* The display was panned since the previous read */
+#define VFB_DAMAGE_PANNED       0x0001
+/* Too many areas were damaged, treat the whole virtual screen as damaged */
+#define VFB_DAMAGE_FULL         0x0002
+
+/* Rectangle in virtual screen coordinates, in pixels */
+struct vfb_rect {
+    __u32 x;
+    __u32 y;
+    __u32 width;
+    __u32 height;
+};
+
+struct vfb_damage {
+    __u32 flags;
+    __u32 count;    /* Number of valid entries in rects */
+    __u32 pan_seq;  /* Sequence number of the pan shown, see VFB_IOCTL_ACK_FLIP */
+    struct vfb_rect rects[VFB_MAX_DAMAGE_RECTS];
+};
+
+/*
+ *  Event protocol
+ *
+ *  After selecting protocol VFB_EVENT_VERSION with VFB_IOCTL_SET_PROTOCOL,
+ *  reading /dev/fb_view returns whole struct vfb_event records instead of the
+ *  screen info: every queued event that fits in the buffer, or a single event
+ *  with the current offsets if nothing is queued. Damage not yet attached to
+ *  an event is returned in an event of its own. Use the size field to step to
+ *  the next record. Every open file starts with the legacy format, and has its
+ *  own protocol, damage, dirty pages and event queue.
+ *
+ *  Each event has a sequence number one higher than the previous event, so a
+ *  gap means events were lost because the queue overflowed. The event after
+ *  a gap has VFB_EVENT_OVERFLOW and VFB_EVENT_DAMAGE_FULL set.
+ */
+
+#define VFB_EVENT_VERSION       1
+
+/* The display was panned, or flipped at a vertical blank */
+#define VFB_EVENT_PAN           0x0001
+/* The video mode changed, fetch the screen info with VFB_IOCTL_GET_SCREENINFO */
+#define VFB_EVENT_MODE_CHANGE   0x0002
+/* Treat the whole virtual screen as damaged, rects is not used */
+#define VFB_EVENT_DAMAGE_FULL   0x0004
+/* Events before this one were lost */
+#define VFB_EVENT_OVERFLOW      0x0008
+/* The color map changed, fetch it with VFB_IOCTL_GET_SCREENINFO */
+#define VFB_EVENT_PALETTE       0x0010
+
+struct vfb_event {
+    __u16 version;          /* VFB_EVENT_VERSION */
+    __u16 size;             /* sizeof(struct vfb_event) */
+    __u32 flags;            /* VFB_EVENT_* */
+    __u64 seq;              /* Event sequence number */
+    __s64 timestamp_ns;     /* CLOCK_MONOTONIC time of the event */
+    __u32 xoffset;          /* Offsets and vmode shown after the event */
+    __u32 yoffset;
+    __u32 vmode;
+    __u32 pan_seq;          /* See VFB_IOCTL_ACK_FLIP */
+    __u32 damage_count;     /* Number of valid entries in rects */
+    __u32 reserved;
+    struct vfb_rect rects[VFB_MAX_DAMAGE_RECTS];    /* Damaged since the previous event */
+};
+
+/*
+ *  Shared event ring
+ *
+ *  After selecting the event protocol, a reader can mmap sizeof(struct vfb_ring)
+ *  bytes at offset 0 of /dev/fb_view, shared and writable, to receive its
+ *  events in memory instead of through read(). The driver stores each event
+ *  in events[head % len] and then increments head. The reader processes the
+ *  events from tail up to head, and then stores the new tail. Both indices
+ *  wrap at 2^32. Load head with acquire and store tail with release ordering.
+ *
+ *  Damage from drawing is moved into the ring when /dev/fb_view is polled or
+ *  read (a read then returns 0), so neither is needed while the ring has
+ *  events. With an eventfd registered, the driver moves it into the ring
+ *  before signalling, when the reader has taken every event or else at the
+ *  next vertical blank, so the ring is read without any system call. Events
+ *  that do not fit are dropped, which shows as a gap in seq, and the next
+ *  event has VFB_EVENT_OVERFLOW and VFB_EVENT_DAMAGE_FULL set.
+ */
+
+#define VFB_RING_LEN            64
+
+struct vfb_ring {
+    __u32 version;          /* VFB_EVENT_VERSION */
+    __u32 len;              /* Number of entries in events */
+    __u32 head;             /* Written by the driver */
+    __u32 tail;             /* Written by the reader */
+    __u32 reserved[12];
+    struct vfb_event events[VFB_RING_LEN];
+};
+
+/*
+ *  Snapshots
+ *
+ *  The viewer copies from video memory while the producer may already draw
+ *  into it. When vfb2 is loaded with snapshot=N, every pan first copies the
+ *  page it shows into the next of N slots, so the viewer can read a page
+ *  exactly as it was at the pan. Drawing into the shown page after a pan is
+ *  not in the copy, and without pans there are no snapshots.
+ *
+ *  Map struct vfb_snapshot read-only at VFB_SNAPSHOT_OFFSET of /dev/fb_view,
+ *  then map again with the size it reports. Slot data starts at the first
+ *  visible row, rows wrapped with FB_VMODE_YWRAP included, and holds yres rows
+ *  of line_length bytes; the first visible pixel is xoffset pixels into it.
+ *  The seq of a slot is odd while the driver writes it. Load seq with acquire
+ *  ordering before reading a slot, and compare it again after reading; a
+ *  different value means the slot was reused meanwhile.
+ */
+
+#define VFB_SNAPSHOT_VERSION    1
+#define VFB_SNAPSHOT_OFFSET     0x10000000
+#define VFB_SNAPSHOT_MAX_SLOTS  4
+#define VFB_SNAPSHOT_NONE       0xffffffff
+
+struct vfb_snapshot_slot {
+    __u32 seq;              /* 0 until first written, odd while written */
+    __u32 pan_seq;          /* Pan the copy was taken for, see VFB_IOCTL_ACK_FLIP */
+    __u32 xoffset;          /* Offsets and mode at the pan */
+    __u32 yoffset;
+    __u32 xres;
+    __u32 yres;
+    __u32 bits_per_pixel;
+    __u32 line_length;      /* Bytes between rows in the copy */
+    __u64 offset;           /* Byte offset of the copy in the mapping */
+};
+
+struct vfb_snapshot {
+    __u32 version;          /* VFB_SNAPSHOT_VERSION */
+    __u32 count;            /* Number of valid entries in slots */
+    __u32 latest;           /* Index of the newest slot, VFB_SNAPSHOT_NONE before the first pan */
+    __u32 reserved;
+    __u64 size;             /* Bytes to map */
+    struct vfb_snapshot_slot slots[VFB_SNAPSHOT_MAX_SLOTS];
+};
+
+/*
+ *  Dirty page tracking
+ *
+ *  When vfb2 is loaded with deferred_io=1, writes through mmap are tracked per
+ *  page of video memory. VFB_IOCTL_GET_DIRTY_PAGES copies the bitmap of pages
+ *  written since the previous call, and clears it.
+ *
+ *  Set bitmap to a user pointer to an array of __u32 words, and count to the
+ *  number of bits available. Bit n of word n / 32 is set if page n is dirty.
+ *  On return count holds the number of pages in video memory. If bitmap is 0
+ *  nothing is copied or cleared, which can be used to size the array.
+ *
+ *  The ioctl fails with EOPNOTSUPP if the driver does not track pages.
+ */
+struct vfb_dirty_pages {
+    __u32 page_size;    /* Bytes per page */
+    __u32 count;        /* Number of bits in bitmap */
+    __u64 bitmap;       /* User pointer to __u32 words */
+};
+
+/*
+ *  Flip acknowledgement
+ *
+ *  Every pan gets a sequence number, reported in struct vfb_damage. When vfb2
+ *  is loaded with flip_ack=1, a pan blocks until a viewer acknowledges, with
+ *  VFB_IOCTL_ACK_FLIP, that it has presented the pan or a later one, or until
+ *  flip_ack_timeout milliseconds have passed. An open file starts holding pans
+ *  back with its first acknowledgement, and pans never block while no such
+ *  file is open.
+ *
+ *  The ioctl works without flip_ack too, to measure pan to present latency.
+ */
+struct vfb_flip_ack {
+    __u32 seq;          /* pan_seq of the presented frame */
+    __u32 reserved;
+    __u64 latency_ns;   /* Out: Nanoseconds from the pan to the acknowledgement,
+                           0 if seq is not the latest pan */
+};
+
+/*
+ *  Eventfd notification
+ *
+ *  VFB_IOCTL_SET_EVENTFD registers an eventfd, created with eventfd(2), that
+ *  the driver signals on every pan and mode change, on the first damage from
+ *  drawing after the previous read, and when pages are written with
+ *  deferred_io. This puts the notifications of /dev/fb_view into an existing
+ *  event loop, without polling the device. The eventfd only tells that there
+ *  is something to read, the changes are still read from /dev/fb_view or the
+ *  shared event ring, which then already holds the damage from drawing.
+ *  Pass -1 to unregister. Each open file has at most one
+ *  eventfd, and the same eventfd can be registered with several files.
+ */
+
+/*
+ *  Screen info
+ *
+ *  VFB_IOCTL_GET_SCREENINFO returns what FBIOGET_VSCREENINFO, FBIOGET_FSCREENINFO
+ *  and FBIOGETCMAP return on the frame buffer device, without taking the frame
+ *  buffer lock. A pan holds that lock while it waits for VFB_IOCTL_ACK_FLIP, so
+ *  a viewer that acknowledges pans must use this instead. The offsets in var
+ *  are those of the last mode set, the events report the current ones.
+ */
+struct vfb_screeninfo {
+    struct fb_var_screeninfo var;
+    __u32 line_length;
+    __u32 smem_len;
+    __u32 smem_seq;         /* Changes when video memory is reallocated, map it again */
+    __u32 reserved;
+    __u16 red[256];
+    __u16 green[256];
+    __u16 blue[256];
+};
+
+#define VFB_IOCTL_MAGIC             'V'
+#define VFB_IOCTL_GET_DIRTY_PAGES   _IOWR(VFB_IOCTL_MAGIC, 1, struct vfb_dirty_pages)
+#define VFB_IOCTL_ACK_FLIP          _IOWR(VFB_IOCTL_MAGIC, 2, struct vfb_flip_ack)
+/* Argument is a pointer to a __u32 protocol version, 0 for the legacy format */
+#define VFB_IOCTL_SET_PROTOCOL      _IOW(VFB_IOCTL_MAGIC, 3, __u32)
+/* Argument is a pointer to a __s32 eventfd file descriptor, -1 to unregister */
+#define VFB_IOCTL_SET_EVENTFD       _IOW(VFB_IOCTL_MAGIC, 4, __s32)
+#define VFB_IOCTL_GET_SCREENINFO    _IOR(VFB_IOCTL_MAGIC, 5, struct vfb_screeninfo)
+
+#endif /* VFB2_H_ */
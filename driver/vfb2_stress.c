@@ -0,0 +1,231 @@
+/*
+ *  vfb2_stress.c -- Pan latency of vfb2 while readers hammer /dev/fb_view.
+ *
+ *      Copyright (C) 2021 RSP Systems <software@rspsystems.com>
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License. See the file COPYING in the main directory of this archive for
+ *  more details.
+ *
+ */
+
+/**
+ *  Pans /dev/fbX back and forth with FBIOPAN_DISPLAY and records how long each
+ *  ioctl takes, first without readers and then while a number of threads poll
+ *  and read /dev/fb_view as fast as they can. A producer that does not block
+ *  on the readers shows about the same latency in both runs.
+ *
+ *  Only uses uapi headers, so it builds without the kernel sources:
+ *
+ *      cc -O2 -pthread -o vfb2_stress vfb2_stress.c
+ *      ./vfb2_stress [-v /dev/fb_view] [-t threads] [-n pans] /dev/fbX
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "vfb2.h"
+
+struct reader_stats {
+    pthread_t thread;
+    unsigned long polls;
+    unsigned long reads;
+    unsigned long errors;
+};
+
+static const char *view_device = "/dev/fb_view";
+static atomic_bool stop_readers;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Uses the legacy read format, which every driver version supports */
+static void *reader_main(void *arg)
+{
+    struct reader_stats *stats = arg;
+    char buffer[sizeof(struct fb_var_screeninfo) + sizeof(struct vfb_damage)];
+    struct pollfd pfd;
+
+    pfd.fd = open(view_device, O_RDONLY);
+    if (pfd.fd < 0) {
+        perror(view_device);
+        stats->errors++;
+        return NULL;
+    }
+    pfd.events = POLLIN;
+
+    while (!atomic_load_explicit(&stop_readers, memory_order_relaxed)) {
+        stats->polls++;
+        if (poll(&pfd, 1, 1) < 0 && errno != EINTR) {
+            stats->errors++;
+            break;
+        }
+        if (read(pfd.fd, buffer, sizeof(buffer)) == sizeof(buffer))
+            stats->reads++;
+        else
+            stats->errors++;
+    }
+
+    close(pfd.fd);
+    return NULL;
+}
+
+static int run_pans(int fd, struct fb_var_screeninfo *var, uint64_t *samples, unsigned count)
+{
+    /* Flip between two pages when there is room for them, else pan in place */
+    unsigned pages = var->yres && var->yres_virtual >= 2 * var->yres ? 2 : 1;
+    unsigned i;
+
+    for (i = 0; i < count; i++) {
+        uint64_t start;
+
+        var->xoffset = 0;
+        var->yoffset = (i % pages) * var->yres;
+        start = now_ns();
+        if (ioctl(fd, FBIOPAN_DISPLAY, var) < 0) {
+            perror("FBIOPAN_DISPLAY");
+            return -1;
+        }
+        samples[i] = now_ns() - start;
+    }
+    return 0;
+}
+
+static void print_latency(const char *label, uint64_t *samples, unsigned count)
+{
+    uint64_t total = 0;
+    unsigned i;
+
+    qsort(samples, count, sizeof(*samples), compare_u64);
+    for (i = 0; i < count; i++)
+        total += samples[i];
+
+    printf("%-12s pans %u  avg %.1f us  p50 %.1f us  p99 %.1f us  p99.9 %.1f us  max %.1f us\n",
+           label, count, total / 1000.0 / count,
+           samples[count / 2] / 1000.0,
+           samples[(uint64_t)count * 99 / 100] / 1000.0,
+           samples[(uint64_t)count * 999 / 1000] / 1000.0,
+           samples[count - 1] / 1000.0);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-v VIEW] [-t THREADS] [-n PANS] FRAMEBUFFER\n"
+            "  -v VIEW     View device to hammer. Defaults to /dev/fb_view\n"
+            "  -t THREADS  Number of reader threads. Defaults to 4\n"
+            "  -n PANS     Number of pans in each run. Defaults to 10000\n",
+            name);
+}
+
+int main(int argc, char *argv[])
+{
+    struct fb_var_screeninfo var;
+    struct reader_stats *readers;
+    unsigned threads = 4;
+    unsigned count = 10000;
+    unsigned long polls = 0, reads = 0, errors = 0;
+    uint64_t *samples;
+    unsigned i;
+    int fd, opt, ret = 1;
+
+    while ((opt = getopt(argc, argv, "v:t:n:h")) != -1) {
+        switch (opt) {
+        case 'v':
+            view_device = optarg;
+            break;
+        case 't':
+            threads = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            count = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || count == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    fd = open(argv[optind], O_RDWR);
+    if (fd < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (ioctl(fd, FBIOGET_VSCREENINFO, &var) < 0) {
+        perror("FBIOGET_VSCREENINFO");
+        goto err1;
+    }
+
+    samples = calloc(count, sizeof(*samples));
+    readers = calloc(threads ? threads : 1, sizeof(*readers));
+    if (!samples || !readers) {
+        fprintf(stderr, "Out of memory\n");
+        goto err2;
+    }
+
+    if (run_pans(fd, &var, samples, count))
+        goto err2;
+    print_latency("no readers", samples, count);
+
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&readers[i].thread, NULL, reader_main, &readers[i])) {
+            fprintf(stderr, "Failed to start reader thread\n");
+            threads = i;
+            break;
+        }
+    }
+
+    ret = run_pans(fd, &var, samples, count) ? 1 : 0;
+
+    atomic_store(&stop_readers, true);
+    for (i = 0; i < threads; i++) {
+        pthread_join(readers[i].thread, NULL);
+        polls += readers[i].polls;
+        reads += readers[i].reads;
+        errors += readers[i].errors;
+    }
+
+    if (ret == 0) {
+        char label[32];
+
+        snprintf(label, sizeof(label), "%u readers", threads);
+        print_latency(label, samples, count);
+        printf("%-12s polls %lu  reads %lu  errors %lu\n", "", polls, reads, errors);
+    }
+
+err2:
+    free(readers);
+    free(samples);
+err1:
+    close(fd);
+    return ret;
+}
@@ -17,30 +17,165 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
 #include <exception>
 #include <string>
 #include <filesystem>
+#include <stdexcept>
+#include <getopt.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "FramebufferViewSDL.h"
+#include "FramebufferViewStream.h"
 
 namespace fs = std::filesystem;
 
-static std::string locateFramebufferDevice();
+static std::string locateDevice(unsigned aInstance, const std::string &arClass);
+static unsigned countInstances();
+static int runView(const std::string &arFrameBuffer, const std::string &arViewDevice, const ViewOptions &arOptions);
+static int runAllInstances(const ViewOptions &arOptions);
+static void usage(const char *apName);
 
 
 int main(int argc, char **argv)
 {
     std::clog << "Framebuffer Emulator ver. 0.4.0 " << argc << std::endl;
 
+    static const struct option long_options[] = {
+        { "tile-hash",  no_argument, nullptr, 't' },
+        { "statistics", no_argument, nullptr, 's' },
+        { "refresh",    required_argument, nullptr, 'r' },
+        { "instance",   required_argument, nullptr, 'i' },
+        { "all",        no_argument, nullptr, 'a' },
+        { "scale",      required_argument, nullptr, 'x' },
+        { "zoom",       required_argument, nullptr, 'z' },
+        { "rotate",     required_argument, nullptr, 'R' },
+        { "output",     required_argument, nullptr, 'o' },
+        { "format",     required_argument, nullptr, 'f' },
+        { "decimate",   required_argument, nullptr, 'd' },
+        { "help",       no_argument, nullptr, 'h' },
+        { nullptr,      0,           nullptr, 0 }
+    };
+
+    ViewOptions options;
+    int instance = -1;
+    bool all = false;
+    std::string format;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "tsr:i:ax:z:R:o:f:d:h", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 't':
+                options.tileHash = true;
+                break;
+            case 's':
+                options.statistics = true;
+                break;
+            case 'r':
+                options.refreshRate = std::atof(optarg);
+                break;
+            case 'i':
+                instance = std::atoi(optarg);
+                break;
+            case 'a':
+                all = true;
+                break;
+            case 'x':
+                try {
+                    options.scaleFilter = Scaler::ParseFilter(optarg);
+                }
+                catch (const std::invalid_argument &e) {
+                    std::cerr << e.what() << std::endl;
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'z':
+                options.zoom = std::max(1, std::atoi(optarg));
+                break;
+            case 'R':
+                try {
+                    options.rotate = Rotator::ParseRotation(optarg);
+                }
+                catch (const std::invalid_argument &e) {
+                    std::cerr << e.what() << std::endl;
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'o':
+                options.outputPath = optarg;
+                break;
+            case 'f':
+                format = optarg;
+                if ((format != "rgba") && (format != "y4m")) {
+                    std::cerr << "Unknown output format: " << format << std::endl;
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'd':
+                options.decimation = std::max(1, std::atoi(optarg));
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (format.empty()) {
+        const std::string &path = options.outputPath;
+        options.y4m = (path.size() >= 4) && (path.compare(path.size() - 4, 4, ".y4m") == 0);
+    } else {
+        options.y4m = format == "y4m";
+    }
+
+    if (all) {
+        if (options.outputPath == "-") {
+            // The streams of all instances would be interleaved on stdout
+            std::cerr << "--all needs a file name for the output, each instance writes to FILE.N" << std::endl;
+            usage(argv[0]);
+            return 1;
+        }
+        return runAllInstances(options);
+    }
+
+    std::string fb;
+    std::string view = "/dev/fb_view";
     try {
-        std::string fb = locateFramebufferDevice();
-        if (argc > 1) {
-            fb = argv[1];
+        if (instance >= 0) {
+            fb = locateDevice(instance, "graphics");
+            view = locateDevice(instance, "fb_view");
         }
+        if (optind < argc) {
+            fb = argv[optind];
+        } else if (fb.empty()) {
+            fb = locateDevice(0, "graphics");
+        }
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Exception: " << e.what() << std::endl;
+        return 0;
+    }
 
-        FramebufferViewSDL view(fb, "/dev/fb_view");
+    return runView(fb, view, options);
+}
 
-        view.run();
+static int runView(const std::string &arFrameBuffer, const std::string &arViewDevice, const ViewOptions &arOptions)
+{
+    try {
+        if (arOptions.outputPath.empty()) {
+            FramebufferViewSDL view(arFrameBuffer, arViewDevice, arOptions);
+            view.run();
+        } else {
+            // No window, so no display server is needed
+            FramebufferViewStream view(arFrameBuffer, arViewDevice, arOptions);
+            view.run();
+        }
     }
     catch (const std::exception &e) {
         std::cerr << "Exception: " << e.what() << std::endl;
@@ -50,13 +185,85 @@ int main(int argc, char **argv)
     return 0;
 }
 
-static std::string locateFramebufferDevice()
+/*
+ * SDL expects all windows to be handled by the thread that initialized video,
+ * and the render loop of a view blocks, so every instance gets a process.
+ */
+static int runAllInstances(const ViewOptions &arOptions)
 {
-    fs::path p = "/sys/devices/platform/vfb2.0/graphics/";
+    unsigned count = countInstances();
+    if (count == 0) {
+        std::cerr << "Could not locate vfb2 device. Please make sure the vfb2 driver is loaded." << std::endl;
+        return 0;
+    }
+
+    for (unsigned i = 0 ; i < count ; i++) {
+        std::string fb, view;
+        try {
+            fb = locateDevice(i, "graphics");
+            view = locateDevice(i, "fb_view");
+        }
+        catch (const std::exception &e) {
+            std::cerr << "Exception: " << e.what() << std::endl;
+            continue;
+        }
+
+        pid_t pid = fork();
+        if (pid == -1) {
+            std::cerr << "Failed to start a viewer for " << fb << std::endl;
+            break;
+        }
+        if (pid == 0) {
+            // Each instance streams to a file of its own
+            ViewOptions options = arOptions;
+            if (!options.outputPath.empty()) {
+                options.outputPath += "." + std::to_string(i);
+            }
+            _exit(runView(fb, view, options));
+        }
+        std::clog << "Viewing " << fb << " in process " << pid << std::endl;
+    }
+
+    while (wait(nullptr) > 0) {
+    }
+
+    std::clog << "Done" << std::endl;
+    return 0;
+}
+
+static std::string locateDevice(unsigned aInstance, const std::string &arClass)
+{
+    fs::path p = "/sys/devices/platform/vfb2." + std::to_string(aInstance) + "/" + arClass + "/";
 
     if (fs::exists(p)) {
         for(auto const& dir_entry: fs::directory_iterator{p})
             return "/dev/" + dir_entry.path().stem().string();
     }
-    throw std::runtime_error("Could not locate vfb2 device. Please make sure the vfb2 driver is loaded.");
+    throw std::runtime_error("Could not locate vfb2 device " + std::to_string(aInstance) + ". Please make sure the vfb2 driver is loaded.");
+}
+
+static unsigned countInstances()
+{
+    unsigned count = 0;
+    while (fs::exists("/sys/devices/platform/vfb2." + std::to_string(count))) {
+        count++;
+    }
+    return count;
+}
+
+static void usage(const char *apName)
+{
+    std::cout << "Usage: " << apName << " [options] [framebuffer device]\n"
+              << "  -t, --tile-hash   Detect changed 64x64 tiles by hashing, when the driver reports no damage\n"
+              << "  -s, --statistics  Print the time spent in each render stage on exit\n"
+              << "  -r, --refresh HZ  Convert at most HZ frames per second, default from the video mode\n"
+              << "  -i, --instance N  View frame buffer N of vfb2, default 0\n"
+              << "  -a, --all         View every frame buffer of vfb2, each in its own window and process\n"
+              << "  -x, --scale MODE  Scale the frame to a resizable window: none (default), nearest or bilinear\n"
+              << "  -z, --zoom N      Open the window at N times the frame size, when scaling\n"
+              << "  -R, --rotate DEG  The content is drawn rotated DEG clockwise for the panel, overrides the video mode\n"
+              << "  -o, --output FILE Write the frames to FILE, a pipe or a FIFO instead of a window, - for stdout\n"
+              << "  -f, --format FMT  Output format rgba (default) or y4m, default y4m for FILE ending in .y4m\n"
+              << "  -d, --decimate N  Write only every N-th frame to the output\n"
+              << "  -h, --help        Show this help" << std::endl;
 }